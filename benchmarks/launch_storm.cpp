@@ -0,0 +1,338 @@
+// The MIT License (MIT)
+//
+// Copyright (c) Itay Grudev 2015 - 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+//
+// singleapplication_bench starts N processes against the same key at the same
+// moment and reports how long they take to decide their role and to get their
+// launch delivered to the primary instance, and how many launches were lost.
+// Every process is this executable started in child mode. Unix only.
+//
+// By default the other processes forward their launch and exit, as most
+// applications use the library. With --secondaries they keep running as
+// secondary instances and send a message instead. Those occupy a slot of the
+// instance registry each while they run.
+//
+// Exits with 1 when a launch was lost or there was not exactly one primary
+// instance, and with 2 when secondary instances didn't fit into the registry.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QHash>
+#include <QtCore/QTemporaryDir>
+#include <QtCore/QTextStream>
+#include <QtCore/QTimer>
+
+#include <singleapplication.h>
+#include <singleapplication_p.h>
+
+#ifdef Q_OS_UNIX
+    #include <fcntl.h>
+    #include <spawn.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+    extern char **environ;
+#endif
+
+static qint64 steadyNSecs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+enum {
+    ExitLost = 1,
+    ExitRegistryOverflow = 2
+};
+
+// A forwarding instance exits from within the SingleApplication constructor,
+// it reports its role decision on the way out
+static qint64 forwardingStart = 0;
+
+static void reportForwarded()
+{
+    if( forwardingStart != 0 ) {
+        printf( "role forwarded %lld\n", static_cast<long long>( steadyNSecs() - forwardingStart ) );
+        fflush( stdout );
+    }
+}
+
+/**
+ * @brief A single launch: --child <index> <start at> <key> <timeout> <expected launches> <linger> <forward|secondary>
+ */
+static int runChild( int argc, char *argv[] )
+{
+    if( argc < 9 )
+        return EXIT_FAILURE;
+
+    const int index = atoi( argv[2] );
+    const qint64 startAt = strtoll( argv[3], nullptr, 10 );
+    const QByteArray key( argv[4] );
+    const int timeout = atoi( argv[5] );
+    const int expected = atoi( argv[6] );
+    const int linger = atoi( argv[7] );
+    const bool forward = qstrcmp( argv[8], "forward" ) == 0;
+
+    // Line up with the other processes
+    qint64 t0 = steadyNSecs();
+    if( t0 < startAt ) {
+        std::this_thread::sleep_for( std::chrono::nanoseconds( startAt - t0 ) );
+        t0 = steadyNSecs();
+    } else {
+        printf( "late %lld\n", static_cast<long long>( t0 - startAt ) );
+    }
+
+    if( forward ) {
+        forwardingStart = t0;
+        atexit( reportForwarded );
+    }
+
+    // The primary instance takes the index and start time from the arguments
+    // of a forwarded launch
+    SingleApplication app( argc, argv, ! forward, SingleApplication::Mode::User | SingleApplication::Mode::ForwardLaunchDetails, key, timeout );
+    const qint64 roleDecision = steadyNSecs() - t0;
+    forwardingStart = 0;
+
+    if( app.isSecondary() ) {
+        // Secondary instances which don't fit into the registry still work,
+        // but nobody sees them
+        bool listed = false;
+        for( const SingleApplication::InstanceInfo &info : app.instances() )
+            listed = listed || info.pid == QCoreApplication::applicationPid();
+        if( ! listed )
+            printf( "unlisted\n" );
+
+        const QByteArray message = QByteArray::number( index ) + ' ' + QByteArray::number( t0 ) + '\n';
+        const bool sent = app.sendMessage( message, timeout );
+        printf( "role secondary %lld %s\n", static_cast<long long>( roleDecision ), sent ? "sent" : "failed" );
+        return EXIT_SUCCESS;
+    }
+
+    printf( "role primary %lld\n", static_cast<long long>( roleDecision ) );
+
+    // Stop once every other launch has been delivered or nothing arrived for a while
+    int received = 0;
+    QTimer idle;
+    idle.setSingleShot( true );
+    idle.setInterval( linger );
+    QObject::connect( &idle, &QTimer::timeout, &app, &QCoreApplication::quit );
+
+    const auto delivered = [&]( int launch, qint64 launchedAt ) {
+        printf( "delivered %d %lld\n", launch, static_cast<long long>( steadyNSecs() - launchedAt ) );
+        if( ++received >= expected )
+            app.quit();
+        else
+            idle.start();
+    };
+
+    // A forwarded launch carries the index and the start time in its
+    // arguments. A process that started late is timed from its launch.
+    QObject::connect( &app, &SingleApplication::instanceLaunched, [&]( quint32, const SingleApplication::LaunchInfo &info ) {
+        if( info.arguments.size() >= 4 )
+            delivered( info.arguments[2].toInt(), qMax( info.arguments[3].toLongLong(), info.launchTime ) );
+    });
+
+    QHash<quint32, QByteArray> pending;
+    QObject::connect( &app, &SingleApplication::receivedMessage, [&]( quint32 instanceId, const QByteArray &data ) {
+        QByteArray &buffer = pending[instanceId];
+        buffer += data;
+
+        int end;
+        while( ( end = buffer.indexOf( '\n' ) ) != -1 ) {
+            const QList<QByteArray> fields = buffer.left( end ).split( ' ' );
+            buffer.remove( 0, end + 1 );
+            if( fields.size() == 2 )
+                delivered( fields[0].toInt(), fields[1].toLongLong() );
+        }
+    });
+
+    if( expected > 0 ) {
+        idle.start();
+        app.exec();
+    }
+
+    fflush( stdout );
+    return EXIT_SUCCESS;
+}
+
+static qint64 percentile( const std::vector<qint64> &sorted, double p )
+{
+    if( sorted.empty() )
+        return 0;
+    const size_t rank = static_cast<size_t>( p * sorted.size() + 0.999999 );
+    return sorted[std::min( sorted.size(), std::max<size_t>( rank, 1 ) ) - 1];
+}
+
+static QString formatNSecs( qint64 nsecs )
+{
+    return QString::number( nsecs / 1e6, 'f', 3 ) + QStringLiteral( " ms" );
+}
+
+static void printDistribution( QTextStream &out, const char *name, std::vector<qint64> samples )
+{
+    std::sort( samples.begin(), samples.end() );
+    out << QString::fromLatin1( name ).leftJustified( 22 )
+        << formatNSecs( percentile( samples, 0.50 ) ).leftJustified( 14 )
+        << formatNSecs( percentile( samples, 0.99 ) ).leftJustified( 14 )
+        << formatNSecs( samples.empty() ? 0 : samples.back() ) << "\n";
+}
+
+static int runDriver( int argc, char *argv[] )
+{
+    QCoreApplication app( argc, argv );
+    QCoreApplication::setApplicationName( QStringLiteral( "singleapplication_bench" ) );
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription( QStringLiteral( "Launches many SingleApplication processes at once against the same key." ) );
+    parser.addHelpOption();
+    QCommandLineOption processesOption( QStringList() << QStringLiteral( "n" ) << QStringLiteral( "processes" ), QStringLiteral( "Number of processes to launch (1-1000)." ), QStringLiteral( "count" ), QStringLiteral( "100" ) );
+    QCommandLineOption timeoutOption( QStringList() << QStringLiteral( "t" ) << QStringLiteral( "timeout" ), QStringLiteral( "SingleApplication timeout in milliseconds." ), QStringLiteral( "msecs" ), QStringLiteral( "1000" ) );
+    QCommandLineOption lingerOption( QStringLiteral( "linger" ), QStringLiteral( "How long the primary waits for a late message in milliseconds." ), QStringLiteral( "msecs" ), QStringLiteral( "3000" ) );
+    QCommandLineOption secondariesOption( QStringLiteral( "secondaries" ), QStringLiteral( "Keep the other processes running as secondary instances which send a message, instead of forwarding their launch." ) );
+    parser.addOption( processesOption );
+    parser.addOption( timeoutOption );
+    parser.addOption( lingerOption );
+    parser.addOption( secondariesOption );
+    parser.process( app );
+
+    QTextStream out( stdout );
+
+#ifdef Q_OS_UNIX
+    const int processes = qBound( 1, parser.value( processesOption ).toInt(), 1000 );
+
+    QTemporaryDir outputDir;
+    if( ! outputDir.isValid() ) {
+        out << "Unable to create a temporary directory\n";
+        return EXIT_FAILURE;
+    }
+
+    // Leave enough time to spawn every process before they all start
+    const qint64 startAt = steadyNSecs() + ( 100 + 2 * processes ) * Q_INT64_C( 1000000 );
+    const QByteArray program = QFile::encodeName( QCoreApplication::applicationFilePath() );
+    const QByteArray key = "singleapplication_bench-" + QByteArray::number( QCoreApplication::applicationPid() ) + '-' + QByteArray::number( startAt );
+    const QByteArray startAtArg = QByteArray::number( startAt );
+    const QByteArray timeoutArg = QByteArray::number( parser.value( timeoutOption ).toInt() );
+    const QByteArray expectedArg = QByteArray::number( processes - 1 );
+    const QByteArray lingerArg = QByteArray::number( parser.value( lingerOption ).toInt() );
+    const QByteArray modeArg = parser.isSet( secondariesOption ) ? "secondary" : "forward";
+
+    std::vector<pid_t> children;
+    for( int index = 0; index < processes; ++index ) {
+        const QByteArray indexArg = QByteArray::number( index );
+        const QByteArray outputPath = QFile::encodeName( QDir( outputDir.path() ).filePath( QString::number( index ) ) );
+
+        char *childArgv[] = {
+            const_cast<char*>( program.constData() ),
+            const_cast<char*>( "--child" ),
+            const_cast<char*>( indexArg.constData() ),
+            const_cast<char*>( startAtArg.constData() ),
+            const_cast<char*>( key.constData() ),
+            const_cast<char*>( timeoutArg.constData() ),
+            const_cast<char*>( expectedArg.constData() ),
+            const_cast<char*>( lingerArg.constData() ),
+            const_cast<char*>( modeArg.constData() ),
+            nullptr
+        };
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init( &actions );
+        posix_spawn_file_actions_addopen( &actions, STDOUT_FILENO, outputPath.constData(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+
+        pid_t pid;
+        if( posix_spawn( &pid, program.constData(), &actions, nullptr, childArgv, environ ) == 0 )
+            children.push_back( pid );
+        posix_spawn_file_actions_destroy( &actions );
+    }
+
+    for( pid_t pid : children )
+        waitpid( pid, nullptr, 0 );
+
+    std::vector<qint64> roleDecisions;
+    std::vector<qint64> deliveries;
+    int primaries = 0;
+    int failedSends = 0;
+    int late = 0;
+    int unlisted = 0;
+
+    for( int index = 0; index < processes; ++index ) {
+        QFile output( QDir( outputDir.path() ).filePath( QString::number( index ) ) );
+        if( ! output.open( QIODevice::ReadOnly ) )
+            continue;
+
+        while( ! output.atEnd() ) {
+            const QList<QByteArray> fields = output.readLine().trimmed().split( ' ' );
+            if( fields[0] == "role" && fields.size() >= 3 ) {
+                roleDecisions.push_back( fields[2].toLongLong() );
+                if( fields[1] == "primary" )
+                    ++primaries;
+                else if( fields.size() >= 4 && fields[3] == "failed" )
+                    ++failedSends;
+            } else if( fields[0] == "delivered" && fields.size() >= 3 ) {
+                deliveries.push_back( fields[2].toLongLong() );
+            } else if( fields[0] == "late" ) {
+                ++late;
+            } else if( fields[0] == "unlisted" ) {
+                ++unlisted;
+            }
+        }
+    }
+
+    const int crashed = processes - static_cast<int>( roleDecisions.size() );
+    const int lost = primaries == 1 ? processes - 1 - static_cast<int>( deliveries.size() ) : -1;
+
+    out << "processes             " << processes << " (" << static_cast<int>( children.size() ) << " spawned, " << late << " started late, " << crashed << " crashed)\n";
+    out << "primaries             " << primaries << "\n";
+    out << "lost launches         " << ( lost < 0 ? QStringLiteral( "n/a" ) : QString::number( lost ) ) << " (" << failedSends << " failed to send)\n";
+    out << "registry overflow     " << unlisted << " (" << static_cast<int>( InstancesInfo::MaxInstances ) << " slots)\n";
+    out << QStringLiteral( "" ).leftJustified( 22 ) << QStringLiteral( "p50" ).leftJustified( 14 ) << QStringLiteral( "p99" ).leftJustified( 14 ) << "max\n";
+    printDistribution( out, "role decision", roleDecisions );
+    printDistribution( out, "message delivered", deliveries );
+
+    if( lost != 0 || primaries != 1 )
+        return ExitLost;
+    if( unlisted > 0 )
+        return ExitRegistryOverflow;
+    return EXIT_SUCCESS;
+#else
+    out << "singleapplication_bench only runs on Unix\n";
+    return EXIT_FAILURE;
+#endif
+}
+
+int main( int argc, char *argv[] )
+{
+    // Children must not create a QCoreApplication before SingleApplication
+    if( argc > 1 && qstrcmp( argv[1], "--child" ) == 0 )
+        return runChild( argc, argv );
+
+    return runDriver( argc, argv );
+}
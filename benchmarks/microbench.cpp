@@ -0,0 +1,364 @@
+// The MIT License (MIT)
+//
+// Copyright (c) Itay Grudev 2015 - 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+//
+// singleapplication_microbench measures the per launch CPU work of
+// SingleApplication in isolation, without spawning processes. Run it with the
+// usual QTest options, e.g. -tickcounter or -iterations.
+//
+// It also counts the heap allocations the primary makes per handshake and per
+// received message and fails when they exceed a fixed budget. The counts are
+// reported in the failure messages.
+//
+
+#include <atomic>
+#include <cstddef>
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QSharedMemory>
+#include <QtCore/QtEndian>
+#include <QtNetwork/QLocalSocket>
+#include <QtTest/QtTest>
+
+#include "singleapplication.h"
+#include "singleapplication_p.h"
+
+#ifdef __GLIBC__
+// Interpose the allocator for the whole process, Qt included. operator new
+// ends up in malloc() so it is covered as well.
+extern "C" void *__libc_malloc( size_t size );
+extern "C" void *__libc_calloc( size_t count, size_t size );
+extern "C" void *__libc_realloc( void *ptr, size_t size );
+
+static std::atomic<quint64> allocationCount( 0 );
+
+extern "C" void *malloc( size_t size )
+{
+    allocationCount.fetch_add( 1, std::memory_order_relaxed );
+    return __libc_malloc( size );
+}
+
+extern "C" void *calloc( size_t count, size_t size )
+{
+    allocationCount.fetch_add( 1, std::memory_order_relaxed );
+    return __libc_calloc( count, size );
+}
+
+extern "C" void *realloc( void *ptr, size_t size )
+{
+    allocationCount.fetch_add( 1, std::memory_order_relaxed );
+    return __libc_realloc( ptr, size );
+}
+
+#define ALLOCATION_COUNTING
+#endif
+
+static quint64 allocations()
+{
+#ifdef ALLOCATION_COUNTING
+    return allocationCount.load( std::memory_order_relaxed );
+#else
+    return 0;
+#endif
+}
+
+// Allocation budgets of the primary. Qt's socket read buffer, its write
+// buffer for the handshake reply and the QByteArray handed to receivedMessage()
+// account for most of them.
+enum {
+    HandshakeAllocationBudget = 5,
+    MessageAllocationBudget = 4,
+    AllocationRounds = 64,
+    FrameBurst = 64
+};
+
+class MicroBenchmark : public QObject
+{
+    Q_OBJECT
+
+public:
+    MicroBenchmark( SingleApplication *app, const QByteArray &key );
+
+private Q_SLOTS:
+    void initTestCase();
+    void cleanupTestCase();
+    void genBlockServerName();
+    void buildInitMessage();
+    void parseInitMessage();
+    void crc32c();
+    void primaryPid();
+    void primaryUser();
+    void readMessageFrames();
+    void handshakeAllocations();
+    void messageAllocations();
+
+private:
+    bool connectToPrimary( QLocalSocket &socket );
+
+    SingleApplication *app;
+    QByteArray appKey;
+    SingleApplicationPrivate *d = nullptr;
+    QByteArray initMessage;
+    QString primaryServerName;
+    QByteArray primaryInitMessage;
+    QByteArray primaryFramedInitMessage;
+    int handshakes = 0;
+    int messages = 0;
+};
+
+MicroBenchmark::MicroBenchmark( SingleApplication *app, const QByteArray &key )
+    : app( app ), appKey( key )
+{
+    connect( app, &SingleApplication::instanceStarted, this, [this]() { ++handshakes; } );
+    connect( app, &SingleApplication::receivedMessage, this, [this]() { ++messages; } );
+}
+
+void MicroBenchmark::initTestCase()
+{
+    QVERIFY( app->isPrimary() );
+
+    d = new SingleApplicationPrivate( nullptr );
+    d->options = SingleApplication::Mode::User;
+    d->genBlockServerName( QByteArray::number( QCoreApplication::applicationPid() ) );
+
+    d->memory = new QSharedMemory( d->blockServerName );
+    QVERIFY( d->memory->create( sizeof( InstancesInfo ) ) );
+    d->initializeMemoryBlock();
+
+    d->instanceNumber = 1;
+    const InitMessage &message = d->buildInitMessage( SingleApplicationPrivate::NewInstance );
+    initMessage = QByteArray( reinterpret_cast<const char*>( &message ), sizeof( message ) );
+
+    // A handshake as a secondary instance of the application object would send
+    SingleApplicationPrivate client( nullptr );
+    client.options = SingleApplication::Mode::User;
+    client.genBlockServerName( appKey );
+    client.instanceNumber = 1;
+    primaryServerName = client.blockServerName;
+    client.negotiatedCapabilities = InitMessage::NoCapabilities;
+    const InitMessage &primaryMessage = client.buildInitMessage( SingleApplicationPrivate::NewInstance );
+    primaryInitMessage = QByteArray( reinterpret_cast<const char*>( &primaryMessage ), sizeof( primaryMessage ) );
+
+    // The same with acknowledged message frames
+    client.negotiatedCapabilities = InitMessage::Acknowledgements;
+    const InitMessage &framedMessage = client.buildInitMessage( SingleApplicationPrivate::NewInstance );
+    primaryFramedInitMessage = QByteArray( reinterpret_cast<const char*>( &framedMessage ), sizeof( framedMessage ) );
+}
+
+void MicroBenchmark::cleanupTestCase()
+{
+    delete d;
+}
+
+void MicroBenchmark::genBlockServerName()
+{
+    const QString blockServerName = d->blockServerName;
+    QBENCHMARK {
+        d->genBlockServerName( QByteArray::number( QCoreApplication::applicationPid() ) );
+    }
+    QCOMPARE( d->blockServerName, blockServerName );
+}
+
+void MicroBenchmark::buildInitMessage()
+{
+    const InitMessage *message = nullptr;
+    QBENCHMARK {
+        message = &d->buildInitMessage( SingleApplicationPrivate::NewInstance );
+    }
+    QCOMPARE( QByteArray( reinterpret_cast<const char*>( message ), sizeof( InitMessage ) ), initMessage );
+}
+
+void MicroBenchmark::parseInitMessage()
+{
+    bool valid = false;
+    QBENCHMARK {
+        SingleApplicationPrivate::InitInfo init;
+        SingleApplication::IpcEvent::RejectReason reason;
+        valid = d->parseInitMessage( initMessage.constData(), initMessage.size(), init, reason );
+    }
+    QVERIFY( valid );
+}
+
+void MicroBenchmark::crc32c()
+{
+    // A megabyte, so that the time per iteration reads as throughput
+    const QByteArray data( 1 << 20, 'x' );
+    quint32 crc = 0;
+    QBENCHMARK {
+        crc = SingleApplicationPrivate::crc32c( data.constData(), static_cast<size_t>( data.size() ) );
+    }
+    QCOMPARE( SingleApplicationPrivate::crc32c( "123456789", 9 ), quint32( 0xe3069283 ) );
+    QCOMPARE( crc, SingleApplicationPrivate::crc32c( data.constData() + 5, static_cast<size_t>( data.size() - 5 ), SingleApplicationPrivate::crc32c( data.constData(), 5 ) ) );
+}
+
+void MicroBenchmark::primaryPid()
+{
+    qint64 pid = 0;
+    QBENCHMARK {
+        pid = d->primaryPid();
+    }
+    QCOMPARE( pid, Q_INT64_C( -1 ) );
+}
+
+void MicroBenchmark::primaryUser()
+{
+    QString user;
+    QBENCHMARK {
+        user = d->primaryUser();
+    }
+    QVERIFY( user.isEmpty() );
+}
+
+/**
+ * @brief Feeds a burst of acknowledged frames through the frame parser of the
+ * primary, as a secondary sends them when the primary was busy
+ */
+void MicroBenchmark::readMessageFrames()
+{
+    QLocalSocket socket;
+    QVERIFY( connectToPrimary( socket ) );
+    socket.write( primaryFramedInitMessage );
+    QVERIFY( socket.waitForBytesWritten() );
+    app->processIpcEvents();
+
+    const QByteArray message( 64, 'x' );
+    MessageFrame header;
+    header.sequence = 0;
+    header.length = qToBigEndian<quint32>( static_cast<quint32>( message.size() ) );
+    header.checksum = qToBigEndian<quint32>( SingleApplicationPrivate::crc32c( message.constData(), static_cast<size_t>( message.size() ) ) );
+
+    QByteArray frames;
+    for( int i = 0; i < FrameBurst; ++i ) {
+        frames.append( reinterpret_cast<const char*>( &header ), sizeof( header ) );
+        frames.append( message );
+    }
+    const int frameSize = static_cast<int>( sizeof( header ) ) + message.size();
+
+    // Frames already handled are dropped, so every burst counts on
+    quint32 sequence = 0;
+    int expected = messages;
+    QBENCHMARK {
+        char *data = frames.data();
+        for( int i = 0; i < FrameBurst; ++i )
+            qToBigEndian<quint32>( ++sequence, data + i * frameSize + offsetof( MessageFrame, sequence ) );
+        socket.write( frames );
+        socket.waitForBytesWritten();
+
+        expected += FrameBurst;
+        for( int round = 0; messages < expected && round < FrameBurst; ++round )
+            app->processIpcEvents();
+    }
+    QCOMPARE( messages, expected );
+
+    // The last acknowledgement covers the last frame. The primary writes it
+    // out on its next call.
+    app->processIpcEvents();
+    QVERIFY( socket.bytesAvailable() > 0 || socket.waitForReadyRead() );
+    const QByteArray acknowledgements = socket.readAll();
+    QVERIFY( acknowledgements.size() >= static_cast<int>( sizeof( quint32 ) ) );
+    QCOMPARE( qFromBigEndian<quint32>( acknowledgements.constData() + acknowledgements.size() - sizeof( quint32 ) ), sequence );
+}
+
+/**
+ * @brief Connects to the primary and lets it accept the connection, so that
+ * the accept is not counted against the handshake
+ */
+bool MicroBenchmark::connectToPrimary( QLocalSocket &socket )
+{
+    socket.connectToServer( primaryServerName );
+    if( ! socket.waitForConnected() )
+        return false;
+
+    app->processIpcEvents();
+    return true;
+}
+
+void MicroBenchmark::handshakeAllocations()
+{
+#ifndef ALLOCATION_COUNTING
+    QSKIP( "Allocation counting requires glibc" );
+#endif
+
+    quint64 worst = 0;
+    for( int i = 0; i < AllocationRounds; ++i ) {
+        QLocalSocket socket;
+        QVERIFY( connectToPrimary( socket ) );
+        socket.write( primaryInitMessage );
+        QVERIFY( socket.waitForBytesWritten() );
+
+        const int expected = handshakes + 1;
+        const quint64 before = allocations();
+        app->processIpcEvents();
+        worst = qMax( worst, allocations() - before );
+
+        QCOMPARE( handshakes, expected );
+    }
+
+    QVERIFY2( worst <= HandshakeAllocationBudget,
+              qPrintable( QStringLiteral( "%1 allocations per handshake, the budget is %2" )
+                  .arg( worst ).arg( HandshakeAllocationBudget ) ) );
+}
+
+void MicroBenchmark::messageAllocations()
+{
+#ifndef ALLOCATION_COUNTING
+    QSKIP( "Allocation counting requires glibc" );
+#endif
+
+    QLocalSocket socket;
+    QVERIFY( connectToPrimary( socket ) );
+    socket.write( primaryInitMessage );
+    QVERIFY( socket.waitForBytesWritten() );
+    app->processIpcEvents();
+
+    const QByteArray message( 64, 'x' );
+    quint64 worst = 0;
+    for( int i = 0; i < AllocationRounds; ++i ) {
+        socket.write( message );
+        QVERIFY( socket.waitForBytesWritten() );
+
+        const int expected = messages + 1;
+        const quint64 before = allocations();
+        app->processIpcEvents();
+        worst = qMax( worst, allocations() - before );
+
+        QCOMPARE( messages, expected );
+    }
+
+    QVERIFY2( worst <= MessageAllocationBudget,
+              qPrintable( QStringLiteral( "%1 allocations per message, the budget is %2" )
+                  .arg( worst ).arg( MessageAllocationBudget ) ) );
+}
+
+int main( int argc, char *argv[] )
+{
+    QCoreApplication::setApplicationName( QStringLiteral( "singleapplication_microbench" ) );
+
+    // The application object is the primary the allocation tests talk to
+    const QByteArray key = "microbench-" + QByteArray::number( QCoreApplication::applicationPid() );
+    SingleApplication app( argc, argv, false, SingleApplication::Mode::User, key );
+
+    MicroBenchmark bench( &app, key );
+    return QTest::qExec( &bench, argc, argv );
+}
+
+#include "microbench.moc"
@@ -0,0 +1,424 @@
+// The MIT License (MIT)
+//
+// Copyright (c) Itay Grudev 2015 - 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+//
+// singleapplication_recovery kills a process at each kill point of the
+// election and measures how long the next launch takes to become the primary
+// instance or to get its message through. The library must be built with
+// SINGLEAPPLICATION_FAULT_INJECTION. Every process is this executable started
+// in child mode. Unix only.
+//
+// Launches run as secondary instances which send a message, or in the
+// forwarding scenarios forward their launch and exit like most applications.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QSharedMemory>
+#include <QtCore/QTemporaryDir>
+#include <QtCore/QTextStream>
+#include <QtCore/QTimer>
+
+#include <singleapplication.h>
+#include "singleapplication_p.h"
+
+#ifdef Q_OS_UNIX
+    #include <fcntl.h>
+    #include <signal.h>
+    #include <spawn.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+    extern char **environ;
+#endif
+
+struct Scenario {
+    const char *killPoint;
+    const char *description;
+    bool holder;        // Another process keeps the block attached
+    bool livePrimary;   // A healthy primary instance runs during the scenario
+    bool victimServes;  // The victim is a primary killed by an incoming launch
+    bool forward;       // Launches forward to the primary instead of staying
+};
+
+static const Scenario scenarios[] = {
+    { "created", "after creating the block, before initialising it", false, false, false, false },
+    { "locked", "while holding the lock", true, false, false, false },
+    { "listening", "between listen() and publishing the primary", true, false, false, false },
+    { "primaryUpdate", "half way through publishing the primary", true, false, false, false },
+    { "sendHandshake", "secondary half way through its handshake", true, true, false, false },
+    { "sendHandshake", "forwarding instance half way through its handshake", true, true, false, true },
+    { "receiveHandshake", "primary half way through reading a handshake", true, false, true, false },
+    { "receiveHandshake", "primary half way through reading a forwarded launch", true, false, true, true },
+};
+
+/**
+ * @brief Tells the scenarios of a kill point apart in keys, file names and
+ * the report
+ */
+static QByteArray scenarioName( const Scenario &scenario )
+{
+    return scenario.forward ? QByteArray( scenario.killPoint ) + "-forward" : QByteArray( scenario.killPoint );
+}
+
+static qint64 steadyNSecs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+/**
+ * @brief A single launch: --child <key> <timeout> <serve> <stay|forward>
+ * Exits successfully once it is the primary instance or its message was sent.
+ * A forwarding launch exits from the constructor, always successfully. A
+ * primary instance keeps serving for <serve> milliseconds and prints every
+ * launch forwarded to it.
+ */
+static int runChild( int argc, char *argv[] )
+{
+    if( argc < 6 )
+        return EXIT_FAILURE;
+
+    const QByteArray key( argv[2] );
+    const int timeout = atoi( argv[3] );
+    const int serve = atoi( argv[4] );
+    const bool forward = qstrcmp( argv[5], "forward" ) == 0;
+
+    SingleApplication app( argc, argv, ! forward, SingleApplication::Mode::User, key, timeout );
+
+    if( app.isSecondary() ) {
+        const bool sent = app.sendMessage( "ping", timeout );
+        printf( "secondary %s\n", sent ? "sent" : "failed" );
+        return sent ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    printf( "primary\n" );
+    fflush( stdout );
+
+    QObject::connect( &app, &SingleApplication::instanceStarted, []() {
+        printf( "launched\n" );
+        fflush( stdout );
+    });
+
+    if( serve > 0 ) {
+        QTimer::singleShot( serve, &app, &QCoreApplication::quit );
+        app.exec();
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief The name of the block the children use for <key>
+ */
+static QString blockServerName( const QByteArray &key )
+{
+    SingleApplicationPrivate d( nullptr );
+    d.options = SingleApplication::Mode::User;
+    d.genBlockServerName( key );
+    return d.blockServerName;
+}
+
+/**
+ * @brief Keeps the block of <key> attached without taking part in the
+ * election: --hold <key>
+ */
+static int runHolder( int argc, char *argv[] )
+{
+    if( argc < 3 )
+        return EXIT_FAILURE;
+
+    QCoreApplication app( argc, argv );
+
+    QSharedMemory memory( blockServerName( QByteArray( argv[2] ) ) );
+    if( ! memory.create( sizeof( InstancesInfo ) ) && ! memory.attach() )
+        return EXIT_FAILURE;
+
+    printf( "holding\n" );
+    fflush( stdout );
+
+    // Until the driver terminates us
+    return app.exec();
+}
+
+#ifdef Q_OS_UNIX
+static pid_t spawnChild( const QList<QByteArray> &args, const QByteArray &outputPath, const QByteArray &killAt = QByteArray() )
+{
+    const QByteArray program = QFile::encodeName( QCoreApplication::applicationFilePath() );
+
+    std::vector<char*> childArgv;
+    childArgv.push_back( const_cast<char*>( program.constData() ) );
+    for( const QByteArray &arg : args )
+        childArgv.push_back( const_cast<char*>( arg.constData() ) );
+    childArgv.push_back( nullptr );
+
+    // Only the victim gets a kill point
+    const QByteArray killAtEntry = "SINGLEAPPLICATION_KILL_AT=" + killAt;
+    std::vector<char*> childEnv;
+    for( char **entry = environ; *entry != nullptr; ++entry ) {
+        if( strncmp( *entry, "SINGLEAPPLICATION_KILL_AT=", 26 ) != 0 )
+            childEnv.push_back( *entry );
+    }
+    if( ! killAt.isEmpty() )
+        childEnv.push_back( const_cast<char*>( killAtEntry.constData() ) );
+    childEnv.push_back( nullptr );
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init( &actions );
+    posix_spawn_file_actions_addopen( &actions, STDOUT_FILENO, outputPath.constData(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+
+    pid_t pid = -1;
+    if( posix_spawn( &pid, program.constData(), &actions, nullptr, childArgv.data(), childEnv.data() ) != 0 )
+        pid = -1;
+    posix_spawn_file_actions_destroy( &actions );
+    return pid;
+}
+
+/**
+ * @brief Waits until a child prints the given line
+ */
+static bool waitForOutput( const QString &path, const QByteArray &line, int msecs )
+{
+    const qint64 deadline = steadyNSecs() + msecs * Q_INT64_C( 1000000 );
+    while( steadyNSecs() < deadline ) {
+        QFile output( path );
+        if( output.open( QIODevice::ReadOnly ) && output.readAll().split( '\n' ).contains( line ) )
+            return true;
+        std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+    }
+    return false;
+}
+
+static void terminateChild( pid_t pid )
+{
+    if( pid <= 0 )
+        return;
+    kill( pid, SIGTERM );
+    waitpid( pid, nullptr, 0 );
+}
+
+/**
+ * @brief The processes a scenario runs next to the victim, reaped when the
+ * scenario ends
+ */
+struct Bystanders {
+    QByteArray key;
+    pid_t holder = -1;
+    pid_t primary = -1;
+    pid_t trigger = -1;
+
+    ~Bystanders()
+    {
+        if( trigger > 0 )
+            waitpid( trigger, nullptr, 0 );
+        terminateChild( primary );
+        terminateChild( holder );
+
+        // Killed processes leave the block behind on Unix, detaching the last
+        // reference to it removes it
+        QSharedMemory memory( blockServerName( key ) );
+        memory.attach();
+    }
+};
+
+enum RunResult {
+    Recovered,
+    NotKilled,
+    NotRecovered,
+    SetupFailed
+};
+
+/**
+ * @brief Kills a victim at the kill point of the scenario and measures the
+ * time from its death until a launch succeeds
+ */
+static RunResult runScenario( const Scenario &scenario, const QDir &outputDir, int run, int timeout, int deadline, qint64 &recovery )
+{
+    const QByteArray key = "singleapplication_recovery-" + QByteArray::number( QCoreApplication::applicationPid() ) + '-' + scenarioName( scenario ) + '-' + QByteArray::number( run );
+    const QByteArray timeoutArg = QByteArray::number( timeout );
+    const QByteArray modeArg = scenario.forward ? "forward" : "stay";
+    const QString prefix = QString::fromLatin1( scenarioName( scenario ) ) + QLatin1Char( '-' ) + QString::number( run ) + QLatin1Char( '-' );
+    auto outputPath = [&]( const QString &name ) {
+        return outputDir.filePath( prefix + name );
+    };
+
+    Bystanders bystanders;
+    bystanders.key = key;
+
+    if( scenario.holder ) {
+        bystanders.holder = spawnChild( { "--hold", key }, QFile::encodeName( outputPath( QStringLiteral( "holder" ) ) ) );
+        if( bystanders.holder <= 0 || ! waitForOutput( outputPath( QStringLiteral( "holder" ) ), "holding", 5000 ) )
+            return SetupFailed;
+    }
+
+    if( scenario.livePrimary ) {
+        bystanders.primary = spawnChild( { "--child", key, timeoutArg, "60000", "stay" }, QFile::encodeName( outputPath( QStringLiteral( "primary" ) ) ) );
+        if( bystanders.primary <= 0 || ! waitForOutput( outputPath( QStringLiteral( "primary" ) ), "primary", 5000 ) )
+            return SetupFailed;
+    }
+
+    const QByteArray serveArg = scenario.victimServes ? "10000" : "0";
+    // A victim killed as the primary instance never forwards anything
+    const pid_t victim = spawnChild( { "--child", key, timeoutArg, serveArg, scenario.victimServes ? "stay" : modeArg }, QFile::encodeName( outputPath( QStringLiteral( "victim" ) ) ), scenario.killPoint );
+    if( victim <= 0 )
+        return SetupFailed;
+
+    // A serving victim dies once a launch hands it a handshake
+    if( scenario.victimServes ) {
+        if( ! waitForOutput( outputPath( QStringLiteral( "victim" ) ), "primary", 5000 ) ) {
+            terminateChild( victim );
+            return SetupFailed;
+        }
+        bystanders.trigger = spawnChild( { "--child", key, timeoutArg, "0", modeArg }, QFile::encodeName( outputPath( QStringLiteral( "trigger" ) ) ) );
+    }
+
+    int status = 0;
+    waitpid( victim, &status, 0 );
+    if( ! WIFSIGNALED( status ) || WTERMSIG( status ) != SIGKILL )
+        return NotKilled;
+
+    const qint64 death = steadyNSecs();
+    const qint64 giveUp = death + deadline * Q_INT64_C( 1000000 );
+
+    for( int probe = 0; steadyNSecs() < giveUp; ++probe ) {
+        const pid_t pid = spawnChild( { "--child", key, timeoutArg, "0", modeArg }, QFile::encodeName( outputPath( QStringLiteral( "probe" ) + QString::number( probe ) ) ) );
+        if( pid <= 0 )
+            break;
+
+        waitpid( pid, &status, 0 );
+        if( ! WIFEXITED( status ) || WEXITSTATUS( status ) != EXIT_SUCCESS )
+            continue;
+
+        // A forwarding launch succeeds once the live primary reports it, the
+        // half handshake of the victim isn't reported
+        if( scenario.forward && scenario.livePrimary &&
+            ! waitForOutput( outputPath( QStringLiteral( "primary" ) ), "launched", static_cast<int>( ( giveUp - steadyNSecs() ) / 1000000 ) ) )
+            return NotRecovered;
+
+        recovery = steadyNSecs() - death;
+        return Recovered;
+    }
+
+    return NotRecovered;
+}
+#endif
+
+static QString formatNSecs( qint64 nsecs )
+{
+    return QString::number( nsecs / 1e6, 'f', 3 ) + QStringLiteral( " ms" );
+}
+
+static int runDriver( int argc, char *argv[] )
+{
+    QCoreApplication app( argc, argv );
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription( QStringLiteral( "Kills SingleApplication processes at each kill point and measures how long the next launch takes to recover." ) );
+    parser.addHelpOption();
+    QCommandLineOption runsOption( QStringList() << QStringLiteral( "r" ) << QStringLiteral( "runs" ), QStringLiteral( "Runs per kill point." ), QStringLiteral( "count" ), QStringLiteral( "5" ) );
+    QCommandLineOption sloOption( QStringLiteral( "slo" ), QStringLiteral( "Maximum recovery time in milliseconds." ), QStringLiteral( "msecs" ), QStringLiteral( "1000" ) );
+    QCommandLineOption timeoutOption( QStringList() << QStringLiteral( "t" ) << QStringLiteral( "timeout" ), QStringLiteral( "SingleApplication timeout in milliseconds." ), QStringLiteral( "msecs" ), QStringLiteral( "1000" ) );
+    QCommandLineOption pointOption( QStringLiteral( "kill-point" ), QStringLiteral( "Only run the given kill point." ), QStringLiteral( "name" ) );
+    parser.addOption( runsOption );
+    parser.addOption( sloOption );
+    parser.addOption( timeoutOption );
+    parser.addOption( pointOption );
+    parser.process( app );
+
+    QTextStream out( stdout );
+
+#ifdef Q_OS_UNIX
+    const int runs = qBound( 1, parser.value( runsOption ).toInt(), 1000 );
+    const int slo = qMax( 1, parser.value( sloOption ).toInt() );
+    const int timeout = parser.value( timeoutOption ).toInt();
+
+    QTemporaryDir outputDir;
+    if( ! outputDir.isValid() ) {
+        out << "Unable to create a temporary directory\n";
+        return EXIT_FAILURE;
+    }
+
+    out << QStringLiteral( "kill point" ).leftJustified( 26 ) << QStringLiteral( "killed" ).leftJustified( 9 ) << QStringLiteral( "recovered" ).leftJustified( 11 )
+        << QStringLiteral( "p50" ).leftJustified( 14 ) << QStringLiteral( "max" ).leftJustified( 14 ) << "\n";
+
+    bool withinSlo = true;
+    for( const Scenario &scenario : scenarios ) {
+        if( parser.isSet( pointOption ) && parser.value( pointOption ) != QLatin1String( scenario.killPoint ) )
+            continue;
+
+        std::vector<qint64> recoveries;
+        int killed = 0;
+        for( int run = 0; run < runs; ++run ) {
+            qint64 recovery = 0;
+            const RunResult result = runScenario( scenario, QDir( outputDir.path() ), run, timeout, 4 * slo, recovery );
+            if( result != NotKilled && result != SetupFailed )
+                ++killed;
+            if( result == Recovered )
+                recoveries.push_back( recovery );
+        }
+
+        std::sort( recoveries.begin(), recoveries.end() );
+        const qint64 p50 = recoveries.empty() ? 0 : recoveries[( recoveries.size() - 1 ) / 2];
+        const qint64 max = recoveries.empty() ? 0 : recoveries.back();
+
+        out << QString::fromLatin1( scenarioName( scenario ) ).leftJustified( 26 )
+            << ( QString::number( killed ) + QLatin1Char( '/' ) + QString::number( runs ) ).leftJustified( 9 )
+            << ( QString::number( recoveries.size() ) + QLatin1Char( '/' ) + QString::number( runs ) ).leftJustified( 11 )
+            << formatNSecs( p50 ).leftJustified( 14 )
+            << formatNSecs( max ).leftJustified( 14 )
+            << scenario.description << "\n";
+        out.flush();
+
+        if( killed != runs || static_cast<int>( recoveries.size() ) != runs || max > slo * Q_INT64_C( 1000000 ) )
+            withinSlo = false;
+    }
+
+    out << QStringLiteral( "slo" ).leftJustified( 26 ) << formatNSecs( slo * Q_INT64_C( 1000000 ) ) << ( withinSlo ? " met" : " missed" ) << "\n";
+
+    return withinSlo ? EXIT_SUCCESS : EXIT_FAILURE;
+#else
+    out << "singleapplication_recovery only runs on Unix\n";
+    return EXIT_FAILURE;
+#endif
+}
+
+int main( int argc, char *argv[] )
+{
+    // Children must not create a QCoreApplication before SingleApplication
+    if( argc > 1 && qstrcmp( argv[1], "--child" ) == 0 )
+        return runChild( argc, argv );
+
+    if( argc > 1 && qstrcmp( argv[1], "--hold" ) == 0 )
+        return runHolder( argc, argv );
+
+    return runDriver( argc, argv );
+}
@@ -0,0 +1,81 @@
+#include <algorithm>
+#include <chrono>
+#include <QDebug>
+#include <QEvent>
+#include <QWidget>
+#include <QWindow>
+#include "activationprobe.h"
+
+static qint64 steadyNSecs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+static QString msecs( qint64 nsecs )
+{
+    return QString::number( nsecs / 1e6, 'f', 2 ) + " ms";
+}
+
+ActivationProbe::ActivationProbe( QWidget *window, QObject *parent )
+    : QObject( parent ), window( window ), launchTime( 0 ), handlersDone( 0 )
+{
+    timeout.setSingleShot( true );
+    timeout.setInterval( 1000 );
+    connect( &timeout, &QTimer::timeout, this, &ActivationProbe::timedOut );
+    window->installEventFilter( this );
+}
+
+void ActivationProbe::instanceLaunched( quint32 instanceId, const SingleApplication::LaunchInfo &info )
+{
+    Q_UNUSED( instanceId );
+
+    // instanceLaunched() is emitted right after the instanceStarted()
+    // handlers, which raise and activate the window, have returned
+    handlersDone = steadyNSecs();
+    launchTime = info.launchTime;
+
+    // The native window only exists once the widget has been shown
+    if( window->windowHandle() != nullptr )
+        window->windowHandle()->installEventFilter( this );
+
+    timeout.start();
+}
+
+bool ActivationProbe::eventFilter( QObject *watched, QEvent *event )
+{
+    if( launchTime != 0 ) {
+        if( event->type() == QEvent::WindowActivate && watched == window )
+            finish( "activated" );
+        else if( event->type() == QEvent::Expose && watched == window->windowHandle() )
+            finish( "exposed" );
+    }
+
+    return QObject::eventFilter( watched, event );
+}
+
+void ActivationProbe::timedOut()
+{
+    qDebug().noquote() << "launch-to-raise: the window was not activated or exposed within 1 s of"
+                       << msecs( handlersDone - launchTime ) << "(was it already in front?)";
+    launchTime = 0;
+}
+
+void ActivationProbe::finish( const char *event )
+{
+    const qint64 total = steadyNSecs() - launchTime;
+    timeout.stop();
+
+    samples.append( total );
+    QVector<qint64> sorted = samples;
+    std::sort( sorted.begin(), sorted.end() );
+
+    qDebug().noquote() << "launch-to-raise:" << msecs( total )
+                       << "(instanceStarted handlers done after" << msecs( handlersDone - launchTime )
+                       << "then window" << event << ")"
+                       << "p50" << msecs( sorted[sorted.size() / 2] )
+                       << "max" << msecs( sorted.last() )
+                       << "over" << sorted.size() << "launches";
+    launchTime = 0;
+}
@@ -0,0 +1,34 @@
+#ifndef ACTIVATIONPROBE_H
+#define ACTIVATIONPROBE_H
+
+#include <QObject>
+#include <QTimer>
+#include <QVector>
+#include <singleapplication.h>
+
+class QWidget;
+
+// Measures the time from the launch of a new instance to the window of the
+// primary instance coming to the front
+class ActivationProbe : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ActivationProbe( QWidget *window, QObject *parent = 0 );
+public slots:
+    void instanceLaunched( quint32 instanceId, const SingleApplication::LaunchInfo &info );
+protected:
+    bool eventFilter( QObject *watched, QEvent *event ) override;
+private slots:
+    void timedOut();
+private:
+    void finish( const char *event );
+
+    QWidget *window;
+    qint64 launchTime;      // 0 unless a launch is being measured
+    qint64 handlersDone;
+    QTimer timeout;
+    QVector<qint64> samples;
+};
+
+#endif // ACTIVATIONPROBE_H
@@ -1,8 +1,10 @@
 QT += widgets
 
-HEADERS = button.h \
+HEADERS = activationprobe.h \
+    button.h \
     calculator.h
-SOURCES = button.cpp \
+SOURCES = activationprobe.cpp \
+    button.cpp \
     calculator.cpp \
     main.cpp
 
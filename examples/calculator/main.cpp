@@ -52,6 +52,7 @@
 
 #include <singleapplication.h>
 
+#include "activationprobe.h"
 #include "calculator.h"
 
 int main(int argc, char *argv[])
@@ -65,6 +66,18 @@ int main(int argc, char *argv[])
         calc.activateWindow();
     });
 
+    // Reports how long it takes from launching another instance to this
+    // window coming to the front
+    ActivationProbe probe( &calc );
+    if( app.arguments().contains( "--measure-activation" ) ) {
+        QObject::connect(
+            &app,
+            &SingleApplication::instanceLaunched,
+            &probe,
+            &ActivationProbe::instanceLaunched
+        );
+    }
+
     calc.show();
 
     return app.exec();
@@ -0,0 +1,56 @@
+#include <chrono>
+#include <cstring>
+#include <QDebug>
+#include <singleapplication.h>
+#include "loadgenerator.h"
+
+qint64 steadyNSecs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+LoadGenerator::LoadGenerator( SingleApplication &app, int rate, int size, int seconds, QObject *parent )
+    : QObject( parent ), app( app ), rate( rate ), seconds( seconds ), sent( 0 ), failed( 0 )
+{
+    LoadFrameHeader header;
+    memcpy( header.magic, "LOAD", sizeof( header.magic ) );
+    header.size = static_cast<quint32>( size );
+    header.sequence = 0;
+    header.sentAt = 0;
+
+    frame.fill( 'x', static_cast<int>( sizeof( header ) ) + size );
+    memcpy( frame.data(), &header, sizeof( header ) );
+
+    timer.setTimerType( Qt::PreciseTimer );
+    timer.setInterval( 1 );
+    connect( &timer, &QTimer::timeout, this, &LoadGenerator::sendDue );
+}
+
+void LoadGenerator::start()
+{
+    elapsed.start();
+    timer.start();
+}
+
+void LoadGenerator::sendDue()
+{
+    // Catch up with the schedule, a timer tick is longer than the interval
+    // between two messages at high rates
+    const qint64 due = elapsed.elapsed() * rate / 1000;
+    while( static_cast<qint64>( sent ) < due ) {
+        LoadFrameHeader *header = reinterpret_cast<LoadFrameHeader*>( frame.data() );
+        header->sequence = sent;
+        header->sentAt = steadyNSecs();
+        if( ! app.sendMessage( frame ) )
+            ++failed;
+        ++sent;
+    }
+
+    if( elapsed.elapsed() >= seconds * 1000 ) {
+        timer.stop();
+        qDebug() << "Sent" << sent << "messages," << failed << "failed.";
+        app.quit();
+    }
+}
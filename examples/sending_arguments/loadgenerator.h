@@ -0,0 +1,41 @@
+#ifndef LOADGENERATOR_H
+#define LOADGENERATOR_H
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QTimer>
+
+class SingleApplication;
+
+// Every message of the load generator starts with this header, the receiver
+// uses it to split the stream back into messages and measure their latency.
+struct LoadFrameHeader
+{
+    char magic[4];      // "LOAD"
+    quint32 size;       // Payload bytes following the header
+    quint64 sequence;
+    qint64 sentAt;      // std::chrono::steady_clock nanoseconds
+};
+
+qint64 steadyNSecs();
+
+class LoadGenerator : public QObject
+{
+    Q_OBJECT
+public:
+    explicit LoadGenerator( SingleApplication &app, int rate, int size, int seconds, QObject *parent = 0 );
+    void start();
+private slots:
+    void sendDue();
+private:
+    SingleApplication &app;
+    int rate;
+    int seconds;
+    QByteArray frame;
+    quint64 sent;
+    quint64 failed;
+    QElapsedTimer elapsed;
+    QTimer timer;
+};
+
+#endif // LOADGENERATOR_H
@@ -1,4 +1,5 @@
 #include <singleapplication.h>
+#include "loadgenerator.h"
 #include "messagereceiver.h"
 
 int main(int argc, char *argv[])
@@ -10,6 +11,19 @@ int main(int argc, char *argv[])
 
     // If this is a secondary instance
     if( app.isSecondary() ) {
+        // Load generator mode: --load <messages per second> <message size> <seconds>
+        const int load = app.arguments().indexOf( "--load" );
+        if( load != -1 && app.arguments().size() > load + 3 ) {
+            LoadGenerator generator(
+                app,
+                app.arguments().at( load + 1 ).toInt(),
+                app.arguments().at( load + 2 ).toInt(),
+                app.arguments().at( load + 3 ).toInt()
+            );
+            generator.start();
+            return app.exec();
+        }
+
         app.sendMessage( app.arguments().join(' ').toUtf8() );
         qDebug() << "App already running.";
         qDebug() << "Primary instance PID: " << app.primaryPid();
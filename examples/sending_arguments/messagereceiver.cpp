@@ -1,12 +1,92 @@
+#include <algorithm>
+#include <cstring>
 #include <QDebug>
+#include "loadgenerator.h"
 #include "messagereceiver.h"
 
-MessageReceiver::MessageReceiver(QObject *parent) : QObject(parent)
+MessageReceiver::MessageReceiver(QObject *parent) : QObject(parent), windowBytes(0)
 {
+    reportTimer.setInterval( 1000 );
+    connect( &reportTimer, &QTimer::timeout, this, &MessageReceiver::reportLoad );
 }
 
 void MessageReceiver::receivedMessage(int instanceId, QByteArray message)
 {
-    qDebug() << "Received message from instance: " << instanceId;
-    qDebug() << "Message Text: " << message;
+    auto buffer = loadBuffers.find( instanceId );
+    if( buffer == loadBuffers.end() ) {
+        if( ! message.startsWith( "LOAD" ) ) {
+            qDebug() << "Received message from instance: " << instanceId;
+            qDebug() << "Message Text: " << message;
+            return;
+        }
+        buffer = loadBuffers.insert( instanceId, QByteArray() );
+    }
+
+    buffer->append( message );
+    receivedLoad( *buffer );
+}
+
+void MessageReceiver::receivedLoad( QByteArray &buffer )
+{
+    if( ! reportTimer.isActive() ) {
+        window.start();
+        reportTimer.start();
+    }
+
+    const int headerSize = static_cast<int>( sizeof( LoadFrameHeader ) );
+    int offset = 0;
+    while( buffer.size() - offset >= headerSize ) {
+        LoadFrameHeader header;
+        memcpy( &header, buffer.constData() + offset, sizeof( header ) );
+        if( memcmp( header.magic, "LOAD", sizeof( header.magic ) ) != 0 ) {
+            qWarning() << "Load generator stream out of sync, dropping" << buffer.size() - offset << "bytes.";
+            offset = buffer.size();
+            break;
+        }
+
+        const int frameSize = headerSize + static_cast<int>( header.size );
+        if( buffer.size() - offset < frameSize )
+            break;
+
+        latencies.append( steadyNSecs() - header.sentAt );
+        windowBytes += static_cast<quint64>( frameSize );
+        offset += frameSize;
+    }
+    buffer.remove( 0, offset );
+}
+
+void MessageReceiver::reportLoad()
+{
+    const double seconds = window.restart() / 1000.0;
+    if( latencies.isEmpty() ) {
+        reportTimer.stop();
+        return;
+    }
+
+    std::sort( latencies.begin(), latencies.end() );
+    const auto percentile = [this]( double p ) {
+        return latencies[qMin( latencies.size() - 1, static_cast<int>( p * latencies.size() ) )] / 1000.0;
+    };
+
+    // Decades of microseconds, the last bucket counts everything above
+    int histogram[6] = {};
+    for( qint64 latency : latencies ) {
+        int bucket = 0;
+        for( qint64 bound = 10000; latency >= bound && bucket < 5; bound *= 10 )
+            ++bucket;
+        ++histogram[bucket];
+    }
+
+    qDebug().noquote() << QString( "%1 msgs/s, %2 MB/s, latency p50 %3 us, p99 %4 us, max %5 us" )
+        .arg( latencies.size() / seconds, 0, 'f', 0 )
+        .arg( windowBytes / seconds / 1e6, 0, 'f', 2 )
+        .arg( percentile( 0.50 ), 0, 'f', 1 )
+        .arg( percentile( 0.99 ), 0, 'f', 1 )
+        .arg( latencies.last() / 1000.0, 0, 'f', 1 );
+    qDebug().noquote() << QString( "  <10us %1, <100us %2, <1ms %3, <10ms %4, <100ms %5, >=100ms %6" )
+        .arg( histogram[0] ).arg( histogram[1] ).arg( histogram[2] )
+        .arg( histogram[3] ).arg( histogram[4] ).arg( histogram[5] );
+
+    latencies.clear();
+    windowBytes = 0;
 }
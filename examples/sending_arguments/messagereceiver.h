@@ -2,6 +2,10 @@
 #define MESSAGERECEIVER_H
 
 #include <QObject>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QTimer>
+#include <QVector>
 
 class MessageReceiver : public QObject
 {
@@ -10,6 +14,17 @@ public:
     explicit MessageReceiver(QObject *parent = 0);
 public slots:
     void receivedMessage( int instanceId, QByteArray message );
+private slots:
+    void reportLoad();
+private:
+    void receivedLoad( QByteArray &buffer );
+
+    // Partial load generator messages per instance
+    QHash<int, QByteArray> loadBuffers;
+    QVector<qint64> latencies;
+    quint64 windowBytes;
+    QElapsedTimer window;
+    QTimer reportTimer;
 };
 
 #endif // MESSAGERECEIVER_H
@@ -3,7 +3,9 @@ include(../../singleapplication.pri)
 DEFINES += QAPPLICATION_CLASS=QCoreApplication
 
 SOURCES += main.cpp \
+    loadgenerator.cpp \
     messagereceiver.cpp
 
 HEADERS += \
+    loadgenerator.h \
     messagereceiver.h
@@ -21,14 +21,8 @@
 // THE SOFTWARE.
 
 #include <QtCore/QElapsedTimer>
-#include <QtCore/QThread>
 #include <QtCore/QByteArray>
 #include <QtCore/QSharedMemory>
-#if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
-#include <QtCore/QRandomGenerator>
-#else
-#include <QtCore/QDateTime>
-#endif
 
 #include "singleapplication.h"
 #include "singleapplication_p.h"
@@ -52,12 +46,18 @@ SingleApplication::SingleApplication( int &argc, char *argv[], bool allowSeconda
     return;
 #endif
 
+    d->startupBegin = SingleApplicationPrivate::steadyNSecs();
+    qint64 phaseStart = d->startupBegin;
+
     // Store the current mode of the program
     d->options = options;
 
     // Generating an application ID used for identifying the shared memory
     // block and QLocalServer
     d->genBlockServerName( extraHashData );
+    d->recordPhase( "genBlockServerName", phaseStart );
+
+    phaseStart = SingleApplicationPrivate::steadyNSecs();
 
 #ifdef Q_OS_UNIX
     // By explicitly attaching it and then deleting it we make sure that the
@@ -71,6 +71,8 @@ SingleApplication::SingleApplication( int &argc, char *argv[], bool allowSeconda
 
     // Create a shared memory block
     if( d->memory->create( sizeof( InstancesInfo ) ) ) {
+        SINGLEAPPLICATION_KILL_POINT( "created" );
+
         // Initialize the shared memory block
         d->memory->lock();
         d->initializeMemoryBlock();
@@ -83,58 +85,124 @@ SingleApplication::SingleApplication( int &argc, char *argv[], bool allowSeconda
             delete d;
             ::exit( EXIT_FAILURE );
         }
-    }
-
-    InstancesInfo* inst = nullptr;
-    QElapsedTimer time;
-    time.start();
 
-    // Make sure the shared memory block is initialised and in consistent state
-    while( true ) {
-        d->memory->lock();
-
-        inst = static_cast<InstancesInfo*>( d->memory->data() );
-
-        if( d->blockChecksum() == inst->checksum ) break;
+        // A block created by an incompatible version of the library
+        if( d->memory->size() < static_cast<int>( sizeof( InstancesInfo ) ) ) {
+            qCritical() << "SingleApplication: Shared memory block is smaller than expected, is another version of the library running?";
+            delete d;
+            ::exit( EXIT_FAILURE );
+        }
+    }
 
-        if( time.elapsed() > 5000 ) {
-            qWarning() << "SingleApplication: Shared memory block has been in an inconsistent state from more than 5s. Assuming primary instance failure.";
+    d->recordPhase( "sharedMemory", phaseStart );
+    d->installCrashDump();
+    phaseStart = SingleApplicationPrivate::steadyNSecs();
+
+    // The name of the block of SingleApplication 3.x contains the user name,
+    // look it up before taking the lock. Only an instance that may become the
+    // primary instance needs it.
+    if( ! SingleApplicationPrivate::isProcessAlive( d->primaryPid() ) || ! d->isPrimaryResponsive() )
+        d->genLegacyServerName( extraHashData );
+
+    QElapsedTimer lockTimer;
+    lockTimer.start();
+    d->memory->lock();
+    d->recordLockWait( lockTimer.nsecsElapsed() );
+    SINGLEAPPLICATION_KILL_POINT( "locked" );
+
+    InstancesInfo* inst = static_cast<InstancesInfo*>( d->memory->data() );
+
+    // Writers hold the lock for the whole update, so an odd sequence seen
+    // while holding it means that the writer died half way through
+    if( inst->sequence.load( std::memory_order_acquire ) & 1 ) {
+        if( SingleApplicationPrivate::isProcessAlive( inst->primaryPid.load( std::memory_order_relaxed ) ) ) {
+            // The writer was a secondary instance updating the instance
+            // counter, or an instance taking over a hung primary that died
+            // before publishing its pid. The fields are consistent either way.
+            // Registry slots have sequences of their own and are repaired when
+            // they are registered or reaped, metrics need no sequence.
+            SingleApplicationPrivate::endWrite( inst->sequence );
+        } else {
+            qWarning() << "SingleApplication: Shared memory block was left in an inconsistent state. Assuming primary instance failure.";
             d->initializeMemoryBlock();
         }
+        d->recordEvent( IpcEvent::BlockRepaired );
+    }
 
-        d->memory->unlock();
+    d->recordPhase( "lock", phaseStart );
+    phaseStart = SingleApplicationPrivate::steadyNSecs();
 
-        // Random sleep here limits the probability of a collision between two racing apps
-#if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
-        QThread::sleep( QRandomGenerator::global()->bounded( 8u, 18u ) );
-#else
-        qsrand( QDateTime::currentMSecsSinceEpoch() % std::numeric_limits<uint>::max() );
-        QThread::sleep( 8 + static_cast <unsigned long>( static_cast <float>( qrand() ) / RAND_MAX * 10 ) );
-#endif
+    // A primary instance built against 3.x is only registered in its own block
+    if( inst->primary == false || ! SingleApplicationPrivate::isProcessAlive( inst->primaryPid.load( std::memory_order_relaxed ) ) ) {
+        d->genLegacyServerName( extraHashData );
+        d->lockLegacyBlock();
+        d->legacyPrimary = d->legacyPrimaryAlive();
+        if( d->legacyPrimary )
+            d->unlockLegacyBlock();
+    }
+
+    if( inst->primary == false && ! d->legacyPrimary ) {
+        d->startPrimary();
+        d->recordEvent( IpcEvent::BecamePrimary, IpcEvent::NoPrimary );
+        d->recordPhase( "startPrimary", phaseStart );
+        d->memory->unlock();
+        d->writeStartupTrace();
+        return;
     }
 
-    if( inst->primary == false) {
+    // A primary instance that crashed could not clear its entry, which is
+    // otherwise only noticed once every process has detached from the block
+    if( ! d->legacyPrimary && ! SingleApplicationPrivate::isProcessAlive( inst->primaryPid.load( std::memory_order_relaxed ) ) ) {
+        qWarning() << "SingleApplication: The primary instance is no longer running. Taking over as primary.";
         d->startPrimary();
+        d->recordEvent( IpcEvent::BecamePrimary, IpcEvent::PrimaryGone );
+        d->recordPhase( "startPrimary", phaseStart );
         d->memory->unlock();
+        d->writeStartupTrace();
         return;
     }
 
+    if( ! d->legacyPrimary && ! d->isPrimaryResponsive() ) {
+        if( d->options & Mode::TakeOverHungPrimary ) {
+            qWarning() << "SingleApplication: The primary instance is not responding. Taking over as primary.";
+            d->genLegacyServerName( extraHashData );
+            d->startPrimary();
+            d->recordEvent( IpcEvent::BecamePrimary, IpcEvent::PrimaryHung );
+            d->recordPhase( "startPrimary", phaseStart );
+            d->memory->unlock();
+            d->writeStartupTrace();
+            return;
+        }
+        qWarning() << "SingleApplication: The primary instance is not responding.";
+    }
+
     // Check if another instance can be started
     if( allowSecondary ) {
         d->startSecondary();
+        d->recordPhase( "startSecondary", phaseStart );
         if( d->options & Mode::SecondaryNotification ) {
+            phaseStart = SingleApplicationPrivate::steadyNSecs();
             d->connectToPrimary( timeout, SingleApplicationPrivate::SecondaryInstance );
+            d->recordPhase( "connectToPrimary", phaseStart );
         }
         d->memory->unlock();
+        d->writeStartupTrace();
         return;
     }
 
     d->memory->unlock();
 
     d->connectToPrimary( timeout, SingleApplicationPrivate::NewInstance );
-
-    delete d;
-
+    d->recordPhase( "connectToPrimary", phaseStart );
+    d->writeStartupTrace();
+
+    // Nothing in the block belongs to this instance, so skip the teardown,
+    // whose detach would take the semaphore again. The process exit unmaps the
+    // block but, unlike QSharedMemory, never removes the segment or its key
+    // file. If the primary instance is gone by then they are left behind until
+    // the next instance attaches to the block and deletes it. The handlers
+    // that dump the flight recorder of the block are no longer needed.
+    d->removeCrashDump();
     ::exit( EXIT_SUCCESS );
 }
 
@@ -159,12 +227,36 @@ bool SingleApplication::isSecondary()
     return d->server == nullptr;
 }
 
+bool SingleApplication::isPrimaryResponsive()
+{
+    Q_D(SingleApplication);
+    return d->isPrimaryResponsive();
+}
+
 quint32 SingleApplication::instanceId()
 {
     Q_D(SingleApplication);
     return d->instanceNumber;
 }
 
+QList<SingleApplication::StartupPhase> SingleApplication::startupTimings()
+{
+    Q_D(SingleApplication);
+    return d->startupPhases;
+}
+
+QList<SingleApplication::InstanceInfo> SingleApplication::instances()
+{
+    Q_D(SingleApplication);
+    return d->instances();
+}
+
+QList<SingleApplication::IpcEvent> SingleApplication::ipcEvents()
+{
+    Q_D(SingleApplication);
+    return SingleApplicationPrivate::readEvents( static_cast<const InstancesInfo*>( d->memory->constData() )->recorder );
+}
+
 qint64 SingleApplication::primaryPid()
 {
     Q_D(SingleApplication);
@@ -177,6 +269,11 @@ QString SingleApplication::primaryUser()
     return d->primaryUser();
 }
 
+void SingleApplication::setPrecomputedKey( const QString &key )
+{
+    SingleApplicationPrivate::precomputedKey = key;
+}
+
 QString SingleApplication::currentUser()
 {
     Q_D(SingleApplication);
@@ -190,11 +287,89 @@ bool SingleApplication::sendMessage( const QByteArray &message, int timeout )
     // Nobody to connect to
     if( isPrimary() ) return false;
 
-    // Make sure the socket is connected
-    d->connectToPrimary( timeout,  SingleApplicationPrivate::Reconnect );
+    bool sent;
+    quint32 sequence = 0;
+    if( d->options & Mode::AcknowledgeMessages ) {
+        sent = d->sendAcknowledged( message, timeout, sequence );
+    } else {
+        // Make sure the socket is connected, a new connection sends the
+        // message along with the handshake
+        sent = d->connectToPrimary( timeout, SingleApplicationPrivate::Reconnect, message );
+    }
+
+    // Keep what couldn't be delivered for the next primary instance. A live
+    // primary may still take in what was written to it, spooling that as well
+    // would deliver it twice.
+    if( ! sent && d->options & Mode::SpoolMessages && ! d->isPrimaryListening() )
+        return d->spoolMessage( message, sequence );
+
+    return sent;
+}
+
+int SingleApplication::ipcEventFd()
+{
+    Q_D(SingleApplication);
+    return d->ipcEventFd();
+}
+
+void SingleApplication::processIpcEvents()
+{
+    Q_D(SingleApplication);
+    d->processIpcEvents();
+}
+
+void SingleApplication::setInboxCapacity( int capacity )
+{
+    Q_D(SingleApplication);
+    d->inboxCapacity = qMax( capacity, 0 );
+    while( d->inbox.size() > d->inboxCapacity ) {
+        d->inbox.dequeue();
+        countMetric( d->metrics().messagesDiscarded );
+    }
+}
+
+void SingleApplication::setMessageTimeToLive( int msecs )
+{
+    Q_D(SingleApplication);
+    d->messageTimeToLive = qMax( msecs, 0 );
+}
 
-    d->socket->write( message );
-    bool dataWritten = d->socket->waitForBytesWritten( timeout );
-    d->socket->flush();
-    return dataWritten;
+int SingleApplication::pendingMessages()
+{
+    Q_D(SingleApplication);
+    d->expireMessages();
+    return d->inbox.size();
+}
+
+QVector<SingleApplication::Message> SingleApplication::takeMessages( int max )
+{
+    Q_D(SingleApplication);
+    return d->takeMessages( max );
+}
+
+void SingleApplication::setBatchingWindow( int msecs )
+{
+    Q_D(SingleApplication);
+
+    if( msecs <= 0 ) {
+        if( d->batchTimer != nullptr ) {
+            d->slotFlushBatch();
+            delete d->batchTimer;
+            d->batchTimer = nullptr;
+        }
+        return;
+    }
+
+    if( d->batchTimer == nullptr ) {
+        d->batchTimer = new QTimer( d );
+        d->batchTimer->setSingleShot( true );
+        d->batchTimer->setTimerType( Qt::PreciseTimer );
+        QObject::connect(
+            d->batchTimer,
+            &QTimer::timeout,
+            d,
+            &SingleApplicationPrivate::slotFlushBatch
+        );
+    }
+    d->batchTimer->setInterval( msecs );
 }
@@ -24,6 +24,10 @@
 #define SINGLE_APPLICATION_H
 
 #include <QtCore/QtGlobal>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QStringList>
+#include <QtCore/QVector>
 #include <QtNetwork/QLocalSocket>
 
 #ifndef QAPPLICATION_CLASS
@@ -54,6 +58,11 @@ public:
      * @note Operating system can restrict the shared memory blocks to the same
      * user, in which case the User/System modes will have no effect and the
      * block will be user wide.
+     * @note Mode::ForwardLaunchDetails forwards the arguments, the working
+     * directory and a fixed list of environment variables: DESKTOP_STARTUP_ID
+     * and XDG_ACTIVATION_TOKEN. They are read before main(), as
+     * QGuiApplication consumes DESKTOP_STARTUP_ID, so the list can't be
+     * changed at runtime.
      * @enum
      */
     enum Mode {
@@ -61,10 +70,96 @@ public:
         System                  = 1 << 1,
         SecondaryNotification   = 1 << 2,
         ExcludeAppVersion       = 1 << 3,
-        ExcludeAppPath          = 1 << 4
+        ExcludeAppPath          = 1 << 4,
+        TakeOverHungPrimary     = 1 << 5,
+        ForwardLaunchDetails    = 1 << 6,
+        AcknowledgeMessages     = 1 << 7,
+        SpoolMessages           = 1 << 8
     };
     Q_DECLARE_FLAGS(Options, Mode)
 
+    /**
+     * @brief An entry of the registry of running instances kept in the shared
+     * memory block
+     * @note The id is tagged with the generation of the primary instance in its
+     * upper 32 bits, its lower 32 bits are the instanceId() of the instance.
+     * Unlike instanceId() it is not reused when the primary restarts.
+     */
+    struct InstanceInfo {
+        quint64 id;
+        qint64 pid;
+        qint64 startTime;   // Milliseconds since the epoch
+        bool primary;
+    };
+
+    /**
+     * @brief Details of a newly started instance, sent in its handshake
+     * @note Only the launch time is sent unless the new instance was started
+     * with Mode::ForwardLaunchDetails.
+     */
+    struct LaunchInfo {
+        qint64 launchTime;  // std::chrono::steady_clock nanoseconds when the process was loaded, 0 if not sent
+        QStringList arguments;
+        QString workingDirectory;
+        QHash<QString, QString> environment;    // DESKTOP_STARTUP_ID and XDG_ACTIVATION_TOKEN, if set
+    };
+
+    /**
+     * @brief A message waiting in the inbox of the primary instance
+     */
+    struct Message {
+        quint32 instanceId;
+        qint64 peerPid;     // -1 if unknown
+        qint64 received;    // Monotonic milliseconds
+        QByteArray message;
+    };
+
+    /**
+     * @brief A phase of the SingleApplication constructor, timed with a
+     * monotonic clock
+     */
+    struct StartupPhase {
+        QString name;
+        qint64 start;       // Nanoseconds since the constructor started
+        qint64 duration;    // Nanoseconds
+    };
+
+    /**
+     * @brief An entry of the IPC flight recorder kept in the shared memory
+     * block. The meaning of detail and value depends on the type.
+     */
+    struct IpcEvent {
+        enum Type : quint16 {
+            ConnectionAccepted  = 1,    // value: peer pid, if known
+            HandshakeAccepted   = 2,    // detail: connection type, value: instance id
+            HandshakeRejected   = 3,    // detail: RejectReason
+            MessageReceived     = 4,    // detail: instance id, value: size in bytes
+            BecamePrimary       = 5,    // detail: ElectionReason
+            BecameSecondary     = 6,    // value: instance id
+            ConnectedToPrimary  = 7,    // detail: connection type
+            ConnectionFailed    = 8,    // detail: connection type
+            LockWaited          = 9,    // value: nanoseconds
+            BlockRepaired       = 10    // A writer died while updating the block
+        };
+        enum RejectReason : quint16 {
+            Malformed           = 1,
+            WrongKey            = 2,
+            BadChecksum         = 3,
+            TooLarge            = 4,
+            WrongUser           = 5     // The peer runs as another user in User mode
+        };
+        enum ElectionReason : quint16 {
+            NoPrimary           = 1,
+            PrimaryGone         = 2,
+            PrimaryHung         = 3
+        };
+        qint64 time;        // std::chrono::steady_clock nanoseconds
+        qint64 pid;
+        Type type;
+        quint32 detail;
+        quint64 value;
+    };
+
     /**
      * @brief Intitializes a SingleApplication instance with argc command line
      * arguments in argv
@@ -88,6 +183,17 @@ public:
     explicit SingleApplication( int &argc, char *argv[], bool allowSecondary = false, Options options = Mode::User, const QByteArray &extraHashData = QByteArray(),int timeout = 1000 );
     ~SingleApplication() override;
 
+    /**
+     * @brief Sets the key naming the shared memory block and the local server,
+     * instead of deriving it from the application details on every launch
+     * @arg {const QString &} key - Short, unique to the application and made
+     * of letters, digits, '-' and '_'. A literal works.
+     * @note Must be called before the constructor. The key replaces the hash
+     * of the application name, version, path and extraHashData. The layout
+     * version of the block and, in User mode, the user are still appended.
+     */
+    static void setPrecomputedKey( const QString &key );
+
     /**
      * @brief Returns if the instance is the primary instance
      * @returns {bool}
@@ -106,6 +212,16 @@ public:
      */
     quint32 instanceId();
 
+    /**
+     * @brief Returns if the primary instance is running and its event loop has
+     * been responsive recently
+     * @returns {bool}
+     * @note The primary instance publishes a heartbeat once per second, it is
+     * considered hung after 5 seconds without one. It is not considered hung
+     * before its event loop has published the first one.
+     */
+    bool isPrimaryResponsive();
+
     /**
      * @brief Returns the process ID (PID) of the primary instance
      * @returns {qint64}
@@ -124,18 +240,126 @@ public:
      */
     QString currentUser();
 
+    /**
+     * @brief Returns how long each phase of the SingleApplication constructor
+     * took, in the order they ran
+     * @returns {QList<StartupPhase>}
+     * @note Set the SINGLEAPPLICATION_TRACE environment variable to a directory
+     * to also have every instance, including those which exit from the
+     * constructor, write them there as a Chrome trace (Perfetto compatible).
+     */
+    QList<StartupPhase> startupTimings();
+
+    /**
+     * @brief Returns the primary and secondary instances currently running
+     * @returns {QList<InstanceInfo>}
+     * @note Instances that only notify the primary instance and exit are not
+     * registered. The registry holds up to 64 instances.
+     */
+    QList<InstanceInfo> instances();
+
+    /**
+     * @brief Returns the most recent IPC events of all instances sharing the
+     * block, oldest first
+     * @returns {QList<IpcEvent>}
+     * @note The flight recorder holds the last 256 events. Set the
+     * SINGLEAPPLICATION_CRASH_DUMP environment variable to a directory to have
+     * an instance that crashes write them there (Unix only). singleapp-stat
+     * decodes both.
+     */
+    QList<IpcEvent> ipcEvents();
+
     /**
      * @brief Sends a message to the primary instance. Returns true on success.
      * @param {int} timeout - Timeout for connecting
      * @returns {bool}
      * @note sendMessage() will return false if invoked from the primary
      * instance.
+     * @note With Mode::AcknowledgeMessages success means that the
+     * receivedMessage() handlers of the primary instance have returned, or
+     * only that the message was queued if the primary uses an inbox or a
+     * batching window. Otherwise it only means that the message was written
+     * to the socket.
+     * @note With Mode::SpoolMessages a message that can't be delivered because
+     * no primary instance is listening is kept on disk for the next one, which
+     * counts as success.
      */
     bool sendMessage( const QByteArray &message, int timeout = 100 );
 
+    /**
+     * @brief Returns a file descriptor that becomes readable whenever the
+     * primary instance has pending connections or data from other instances.
+     * It can be registered with a foreign event loop (epoll, libuv, etc.)
+     * @returns {int} The descriptor or -1 if the instance is not primary or the
+     * platform does not support it
+     * @note The descriptor is owned by SingleApplication and must not be
+     * closed or read from. Call processIpcEvents() once it becomes readable.
+     * @note Only supported on Linux with Qt 5.10 or newer.
+     */
+    int ipcEventFd();
+
+    /**
+     * @brief Accepts pending connections and processes pending data from other
+     * instances without running the Qt event loop
+     * @note Signals are emitted synchronously from within this call.
+     * @note It also publishes the heartbeat of the primary instance, without
+     * the Qt event loop it must be called at least once per second or the
+     * instance is reported as hung. See isPrimaryResponsive().
+     */
+    void processIpcEvents();
+
+    /**
+     * @brief Keeps received messages in an inbox instead of emitting
+     * receivedMessage() for each of them
+     * @arg {int} capacity - The most messages the inbox holds, the oldest is
+     * discarded to make room. 0, the default, disables the inbox.
+     * @note messagesAvailable() is emitted when a message arrives in an empty
+     * inbox, the application takes the messages with takeMessages() when it
+     * is ready for them.
+     */
+    void setInboxCapacity( int capacity );
+
+    /**
+     * @brief Discards messages which have been in the inbox for longer than
+     * msecs milliseconds
+     * @arg {int} msecs - 0, the default, keeps them until they are taken
+     */
+    void setMessageTimeToLive( int msecs );
+
+    /**
+     * @brief Returns the number of messages in the inbox
+     * @returns {int}
+     */
+    int pendingMessages();
+
+    /**
+     * @brief Takes up to max messages out of the inbox, oldest first
+     * @arg {int} max - -1 takes all of them
+     * @returns {QVector<Message>}
+     */
+    QVector<Message> takeMessages( int max = -1 );
+
+    /**
+     * @brief Collects what other instances send for msecs milliseconds and
+     * delivers it at once
+     * @arg {int} msecs - The length of the window, opened by the first
+     * activation or message after the last one closed. 0, the default,
+     * delivers everything as it arrives.
+     * @note Within a window instanceStarted() is emitted once and messages
+     * are delivered by a single receivedMessages() instead of
+     * receivedMessage(), with identical payloads collapsed into the first.
+     * The inbox, if enabled, takes precedence for messages.
+     */
+    void setBatchingWindow( int msecs );
+
 Q_SIGNALS:
     void instanceStarted();
+    void instanceLaunched( quint32 instanceId, const SingleApplication::LaunchInfo &info );
+    void instanceStopped( quint64 id );
     void receivedMessage( quint32 instanceId, const QByteArray &message );
+    void receivedMessageFrom( quint32 instanceId, qint64 peerPid, const QByteArray &message );
+    void messagesAvailable();
+    void receivedMessages( const QVector<SingleApplication::Message> &messages );
 
 private:
     SingleApplicationPrivate *d_ptr;
@@ -143,5 +367,7 @@ private:
 };
 
 Q_DECLARE_OPERATORS_FOR_FLAGS(SingleApplication::Options)
+Q_DECLARE_METATYPE(SingleApplication::LaunchInfo)
+Q_DECLARE_METATYPE(SingleApplication::Message)
 
 #endif // SINGLE_APPLICATION_H
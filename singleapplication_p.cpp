@@ -29,13 +29,31 @@
 // version without notice, or may even be removed.
 //
 
+#include <chrono>
 #include <cstdlib>
 #include <cstddef>
+#include <cstring>
+#include <limits>
 
+#include <QtCore/QDateTime>
+#include <QtCore/QDataStream>
+#include <QtCore/QDebug>
 #include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QtEndian>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QStandardPaths>
+#include <QtCore/QThread>
+#include <QtCore/QVarLengthArray>
 #include <QtCore/QByteArray>
-#include <QtCore/QDataStream>
 #include <QtCore/QCryptographicHash>
+#if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
+#include <QtCore/QRandomGenerator>
+#endif
 #include <QtNetwork/QLocalServer>
 #include <QtNetwork/QLocalSocket>
 
@@ -43,41 +61,257 @@
 #include "singleapplication_p.h"
 
 #ifdef Q_OS_UNIX
+    #include <cerrno>
+    #include <fcntl.h>
+    #include <signal.h>
     #include <unistd.h>
     #include <sys/types.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
     #include <pwd.h>
 #endif
 
+#ifdef Q_OS_LINUX
+    #include <sys/epoll.h>
+#endif
+
 #ifdef Q_OS_WIN
     #include <windows.h>
     #include <lmcons.h>
 #endif
 
+#if defined( Q_PROCESSOR_X86_64 ) && ( defined( Q_CC_GNU ) || defined( Q_CC_MSVC ) )
+    #define SINGLEAPPLICATION_CRC32C_SSE42
+    #include <nmmintrin.h>
+    #ifdef Q_CC_MSVC
+        #include <intrin.h>
+    #endif
+#elif defined( Q_PROCESSOR_ARM_64 ) && defined( __ARM_FEATURE_CRC32 )
+    #define SINGLEAPPLICATION_CRC32C_ARMV8
+    #include <arm_acle.h>
+#endif
+
+QString SingleApplicationPrivate::precomputedKey;
+
+// Taken as early as possible in the life of the process, before main()
+static const qint64 processLaunchTime = SingleApplicationPrivate::steadyNSecs();
+
+// Also read before main(), as QGuiApplication consumes DESKTOP_STARTUP_ID
+static const char *const startupVariableNames[] = { "DESKTOP_STARTUP_ID", "XDG_ACTIVATION_TOKEN" };
+static const int startupVariableCount = sizeof( startupVariableNames ) / sizeof( startupVariableNames[0] );
+static const QByteArray startupVariables[] = { qgetenv( startupVariableNames[0] ), qgetenv( startupVariableNames[1] ) };
+
+#ifdef Q_OS_UNIX
+// The crash dump handler may only make async-signal-safe calls, so everything
+// it needs is prepared by installCrashDump()
+static const int crashDumpSignals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+static const int crashDumpSignalCount = sizeof( crashDumpSignals ) / sizeof( crashDumpSignals[0] );
+static struct sigaction previousCrashActions[crashDumpSignalCount];
+static char crashDumpPath[4096];
+static const FlightRecorder *crashDumpRecorder = nullptr;
+
+static void writeCrashDump( int fd, const void *data, size_t size )
+{
+    const char *bytes = static_cast<const char*>( data );
+    while( size > 0 ) {
+        const ssize_t written = ::write( fd, bytes, size );
+        if( written <= 0 )
+            return;
+        bytes += written;
+        size -= static_cast<size_t>( written );
+    }
+}
+
+static void restoreCrashHandlers()
+{
+    for( int i = 0; i < crashDumpSignalCount; ++i )
+        sigaction( crashDumpSignals[i], &previousCrashActions[i], nullptr );
+    crashDumpRecorder = nullptr;
+}
+
+static void crashDumpHandler( int signal )
+{
+    if( crashDumpRecorder != nullptr ) {
+        const int fd = ::open( crashDumpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+        if( fd != -1 ) {
+            const quint64 magic = FlightRecorderDumpMagic;
+            writeCrashDump( fd, &magic, sizeof( magic ) );
+            writeCrashDump( fd, crashDumpRecorder, sizeof( FlightRecorder ) );
+            ::close( fd );
+        }
+    }
+
+    // Let whoever handled the signal before us, or the default action, finish
+    restoreCrashHandlers();
+    raise( signal );
+}
+#endif
+
+/**
+ * @brief Lookup tables of the portable CRC32C, processing eight bytes per step
+ */
+struct Crc32cTable {
+    Crc32cTable()
+    {
+        // Reflected Castagnoli polynomial
+        for( quint32 i = 0; i < 256; ++i ) {
+            quint32 crc = i;
+            for( int bit = 0; bit < 8; ++bit )
+                crc = ( crc >> 1 ) ^ ( ( crc & 1 ) ? 0x82f63b78 : 0 );
+            entries[0][i] = crc;
+        }
+        for( quint32 i = 0; i < 256; ++i ) {
+            for( int slice = 1; slice < 8; ++slice )
+                entries[slice][i] = ( entries[slice - 1][i] >> 8 ) ^ entries[0][entries[slice - 1][i] & 0xff];
+        }
+    }
+    quint32 entries[8][256];
+};
+
+static quint32 crc32cPortable( quint32 crc, const uchar *data, size_t size )
+{
+    static const Crc32cTable table;
+    const quint32 (*entries)[256] = table.entries;
+
+    while( size >= 8 ) {
+        const quint32 low = crc ^ qFromLittleEndian<quint32>( data );
+        const quint32 high = qFromLittleEndian<quint32>( data + 4 );
+        crc = entries[7][low & 0xff] ^ entries[6][( low >> 8 ) & 0xff] ^
+              entries[5][( low >> 16 ) & 0xff] ^ entries[4][low >> 24] ^
+              entries[3][high & 0xff] ^ entries[2][( high >> 8 ) & 0xff] ^
+              entries[1][( high >> 16 ) & 0xff] ^ entries[0][high >> 24];
+        data += 8;
+        size -= 8;
+    }
+    while( size > 0 ) {
+        crc = ( crc >> 8 ) ^ entries[0][( crc ^ *data++ ) & 0xff];
+        --size;
+    }
+    return crc;
+}
+
+#ifdef SINGLEAPPLICATION_CRC32C_SSE42
+#ifdef Q_CC_GNU
+__attribute__(( target( "sse4.2" ) ))
+#endif
+static quint32 crc32cSse42( quint32 crc, const uchar *data, size_t size )
+{
+    quint64 crc64 = crc;
+    while( size >= 8 ) {
+        quint64 word;
+        memcpy( &word, data, sizeof( word ) );
+        crc64 = _mm_crc32_u64( crc64, word );
+        data += 8;
+        size -= 8;
+    }
+    crc = static_cast<quint32>( crc64 );
+    while( size > 0 ) {
+        crc = _mm_crc32_u8( crc, *data++ );
+        --size;
+    }
+    return crc;
+}
+#endif
+
+#ifdef SINGLEAPPLICATION_CRC32C_ARMV8
+static quint32 crc32cArmv8( quint32 crc, const uchar *data, size_t size )
+{
+    while( size >= 8 ) {
+        quint64 word;
+        memcpy( &word, data, sizeof( word ) );
+        crc = __crc32cd( crc, word );
+        data += 8;
+        size -= 8;
+    }
+    while( size > 0 ) {
+        crc = __crc32cb( crc, *data++ );
+        --size;
+    }
+    return crc;
+}
+#endif
+
+typedef quint32 (*Crc32cFunction)( quint32 crc, const uchar *data, size_t size );
+
+/**
+ * @brief Picks the CRC32C instructions of the CPU the process runs on, if it
+ * has them
+ */
+static Crc32cFunction resolveCrc32c()
+{
+#if defined( SINGLEAPPLICATION_CRC32C_SSE42 ) && defined( Q_CC_MSVC )
+    int info[4];
+    __cpuid( info, 1 );
+    if( info[2] & ( 1 << 20 ) )
+        return crc32cSse42;
+#elif defined( SINGLEAPPLICATION_CRC32C_SSE42 )
+    if( __builtin_cpu_supports( "sse4.2" ) )
+        return crc32cSse42;
+#elif defined( SINGLEAPPLICATION_CRC32C_ARMV8 )
+    return crc32cArmv8;
+#endif
+    return crc32cPortable;
+}
+
 SingleApplicationPrivate::SingleApplicationPrivate( SingleApplication *q_ptr )
     : q_ptr( q_ptr )
 {
     server = nullptr;
     socket = nullptr;
     memory = nullptr;
+    legacyMemory = nullptr;
+    legacyServer = nullptr;
+    legacyLocked = false;
+    legacyPrimary = false;
     instanceNumber = -1;
+    ipcEpollFd = -1;
+    instanceSlot = nullptr;
+    registryTimer = nullptr;
+    startupBegin = 0;
+    blockKeyHash = 0;
+    memset( &initMessage, 0, sizeof( initMessage ) );
+    negotiatedVersion = InitMessage::Version;
+    negotiatedCapabilities = InitMessage::Capabilities;
+    initReplyRead = true;
+    messageSequence = 0;
+    spoolReplayPending = false;
+    inboxCapacity = 0;
+    messageTimeToLive = 0;
+    batchTimer = nullptr;
+    batchStarted = false;
 }
 
 SingleApplicationPrivate::~SingleApplicationPrivate()
 {
     if( memory != nullptr ) {
-        memory->lock();
+        unregisterInstance();
+
+        removeCrashDump();
+
+        // Only the primary instance has anything to write back. A primary that
+        // was taken over while it was hung must not reset the block of its
+        // successor.
         InstancesInfo* inst = static_cast<InstancesInfo*>(memory->data());
         if( instanceNumber == 0 ) {
-            inst->primary = false;
-            inst->primaryPid = -1;
-            inst->primaryUser[0] =  '\0';
-            inst->checksum = blockChecksum();
+            memory->lock();
+            if( inst->primaryPid.load( std::memory_order_relaxed ) == QCoreApplication::applicationPid() ) {
+                beginWrite( inst->sequence );
+                inst->primary.store( false, std::memory_order_relaxed );
+                inst->primaryPid.store( -1, std::memory_order_relaxed );
+                inst->primaryVersion.store( 0, std::memory_order_relaxed );
+                inst->primaryCapabilities.store( 0, std::memory_order_relaxed );
+                inst->primaryUid.store( -1, std::memory_order_relaxed );
+                inst->primaryUser[0] =  '\0';
+                endWrite( inst->sequence );
+            }
+            memory->unlock();
         }
-        memory->unlock();
 
         delete memory;
     }
 
+    releaseLegacyBlock();
+
     if( socket != nullptr ) {
         socket->close();
         delete socket;
@@ -87,6 +321,11 @@ SingleApplicationPrivate::~SingleApplicationPrivate()
         server->close();
         delete server;
     }
+
+#ifdef Q_OS_LINUX
+    if( ipcEpollFd != -1 )
+        ::close( ipcEpollFd );
+#endif
 }
 
 QString SingleApplicationPrivate::getUsername()
@@ -104,11 +343,7 @@ QString SingleApplicationPrivate::getUsername()
 #endif
 #endif
 #ifdef Q_OS_UNIX
-      QString username;
-      uid_t uid = geteuid();
-      struct passwd *pw = getpwuid( uid );
-      if( pw )
-          username = QString::fromLocal8Bit( pw->pw_name );
+      QString username = usernameForUid( static_cast<qint64>( geteuid() ) );
       if ( username.isEmpty() ) {
 #if QT_VERSION < QT_VERSION_CHECK(5, 10, 0)
           username = QString::fromLocal8Bit( qgetenv( "USER" ) );
@@ -120,10 +355,97 @@ QString SingleApplicationPrivate::getUsername()
 #endif
 }
 
+/**
+ * @brief Looks up the name of a user. This goes through NSS, which may end up
+ * asking a directory service, so it is kept off the launch path.
+ * @returns {QString} The name or an empty string if unknown
+ */
+QString SingleApplicationPrivate::usernameForUid( qint64 uid )
+{
+#ifdef Q_OS_UNIX
+    if( uid < 0 )
+        return QString();
+
+    struct passwd *pw = getpwuid( static_cast<uid_t>( uid ) );
+    if( pw )
+        return QString::fromLocal8Bit( pw->pw_name );
+#else
+    Q_UNUSED( uid );
+#endif
+    return QString();
+}
+
+/**
+ * @brief Identifies the current user in the key of a User mode block. On Unix
+ * this is the effective uid, which unlike the name needs no lookup through
+ * NSS that may end up asking a directory service.
+ */
+QByteArray SingleApplicationPrivate::userScope()
+{
+#ifdef Q_OS_UNIX
+    return QByteArray::number( static_cast<quint64>( geteuid() ) );
+#else
+    return getUsername().toUtf8();
+#endif
+}
+
 void SingleApplicationPrivate::genBlockServerName( const QByteArray &extraHashData )
 {
+    // Nothing to derive
+    if( ! precomputedKey.isEmpty() ) {
+        blockServerName = precomputedKey + QLatin1Char( '-' ) + QString::number( InstancesInfo::LayoutVersion );
+        if( options & SingleApplication::Mode::User )
+            blockServerName += QLatin1Char( '-' ) + QString::fromLatin1( userScope() );
+        blockKeyHash = keyHash( blockServerName );
+        return;
+    }
+
+    QCryptographicHash appData( QCryptographicHash::Sha256 );
+    appData.addData( "SingleApplication", 17 );
+    const quint32 layoutVersion = qToBigEndian<quint32>( InstancesInfo::LayoutVersion );
+    appData.addData( reinterpret_cast<const char*>( &layoutVersion ), sizeof( layoutVersion ) );
+    addApplicationData( appData, extraHashData );
+
+    // User level block requires a user specific data in the hash
+    if( options & SingleApplication::Mode::User ) {
+        appData.addData( userScope() );
+    }
+
+    // Replace the backslash in RFC 2045 Base64 [a-zA-Z0-9+/=] to comply with
+    // server naming requirements.
+    blockServerName = appData.result().toBase64().replace("/", "_");
+    blockKeyHash = keyHash( blockServerName );
+}
+
+/**
+ * @brief Derives the name SingleApplication 3.x gives the block and the
+ * server of this application. It contains the user name in User mode, which
+ * may take a lookup through NSS, so it is only derived by instances that may
+ * become the primary instance and only once.
+ */
+void SingleApplicationPrivate::genLegacyServerName( const QByteArray &extraHashData )
+{
+    // 3.x has no precomputed keys
+    if( ! legacyServerName.isEmpty() || ! precomputedKey.isEmpty() )
+        return;
+
+    legacyUser = getUsername().toUtf8();
+
     QCryptographicHash appData( QCryptographicHash::Sha256 );
     appData.addData( "SingleApplication", 17 );
+    addApplicationData( appData, extraHashData );
+    if( options & SingleApplication::Mode::User ) {
+        appData.addData( legacyUser );
+    }
+
+    legacyServerName = appData.result().toBase64().replace("/", "_");
+}
+
+/**
+ * @brief Adds what identifies the application to the hash of a block name
+ */
+void SingleApplicationPrivate::addApplicationData( QCryptographicHash &appData, const QByteArray &extraHashData )
+{
     appData.addData( SingleApplication::app_t::applicationName().toUtf8() );
     appData.addData( SingleApplication::app_t::organizationName().toUtf8() );
     appData.addData( SingleApplication::app_t::organizationDomain().toUtf8() );
@@ -143,25 +465,59 @@ void SingleApplicationPrivate::genBlockServerName( const QByteArray &extraHashDa
         appData.addData( SingleApplication::app_t::applicationFilePath().toUtf8() );
 #endif
     }
+}
 
-    // User level block requires a user specific data in the hash
-    if( options & SingleApplication::Mode::User ) {
-        appData.addData( getUsername().toUtf8() );
+/**
+ * @brief 64-bit FNV-1a hash of the UTF-8 bytes of a server name, which
+ * identifies the block in the handshake without sending the name itself. A
+ * precomputed key may contain any character.
+ */
+quint64 SingleApplicationPrivate::keyHash( const QString &name )
+{
+    const QByteArray bytes = name.toUtf8();
+    quint64 hash = Q_UINT64_C( 14695981039346656037 );
+    for( const char c : bytes ) {
+        hash ^= static_cast<quint8>( c );
+        hash *= Q_UINT64_C( 1099511628211 );
     }
+    return hash;
+}
 
-    // Replace the backslash in RFC 2045 Base64 [a-zA-Z0-9+/=] to comply with
-    // server naming requirements.
-    blockServerName = appData.result().toBase64().replace("/", "_");
+/**
+ * @brief CRC32C (Castagnoli) of a buffer, computed with the SSE4.2 or ARMv8
+ * CRC instructions where available. Pass the CRC of the preceding data to
+ * continue it.
+ */
+quint32 SingleApplicationPrivate::crc32c( const char *data, size_t size, quint32 crc )
+{
+    static const Crc32cFunction function = resolveCrc32c();
+    return ~function( ~crc, reinterpret_cast<const uchar*>( data ), size );
 }
 
 void SingleApplicationPrivate::initializeMemoryBlock()
 {
     InstancesInfo* inst = static_cast<InstancesInfo*>( memory->data() );
-    inst->primary = false;
-    inst->secondary = 0;
-    inst->primaryPid = -1;
+
+    // The block may be recovered from a writer that died half way through an
+    // update
+    restartWrite( inst->sequence );
+    inst->primary.store( false, std::memory_order_relaxed );
+    inst->secondary.store( 0, std::memory_order_relaxed );
+    // A random starting generation keeps instance ids unique across the
+    // lifetimes of the block
+#if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
+    inst->generation.store( QRandomGenerator::global()->generate(), std::memory_order_relaxed );
+#else
+    qsrand( QDateTime::currentMSecsSinceEpoch() % std::numeric_limits<uint>::max() );
+    inst->generation.store( static_cast<quint32>( qrand() ), std::memory_order_relaxed );
+#endif
+    inst->primaryPid.store( -1, std::memory_order_relaxed );
+    inst->primaryHeartbeat.store( 0, std::memory_order_relaxed );
+    inst->primaryVersion.store( 0, std::memory_order_relaxed );
+    inst->primaryCapabilities.store( 0, std::memory_order_relaxed );
+    inst->primaryUid.store( -1, std::memory_order_relaxed );
     inst->primaryUser[0] =  '\0';
-    inst->checksum = blockChecksum();
+    endWrite( inst->sequence );
 }
 
 void SingleApplicationPrivate::startPrimary()
@@ -182,6 +538,7 @@ void SingleApplicationPrivate::startPrimary()
     }
 
     server->listen( blockServerName );
+    SINGLEAPPLICATION_KILL_POINT( "listening" );
     QObject::connect(
         server,
         &QLocalServer::newConnection,
@@ -192,259 +549,1830 @@ void SingleApplicationPrivate::startPrimary()
     // Reset the number of connections
     InstancesInfo* inst = static_cast <InstancesInfo*>( memory->data() );
 
-    inst->primary = true;
-    inst->primaryPid = q->applicationPid();
-    strncpy( inst->primaryUser, getUsername().toUtf8().data(), 127 );
+    // The lock is held here, so on Unix only the uid is published and the
+    // name is looked up by whoever asks for it. GetUserName() reads the
+    // process token and is cheap.
+#ifdef Q_OS_UNIX
+    const qint64 uid = static_cast<qint64>( geteuid() );
+    const QByteArray username;
+#else
+    const qint64 uid = -1;
+    const QByteArray username = getUsername().toUtf8();
+#endif
+
+    beginWrite( inst->sequence );
+    inst->primary.store( true, std::memory_order_relaxed );
+    SINGLEAPPLICATION_KILL_POINT( "primaryUpdate" );
+    inst->generation.fetch_add( 1, std::memory_order_relaxed );
+    inst->primaryPid.store( q->applicationPid(), std::memory_order_relaxed );
+    inst->primaryVersion.store( InitMessage::Version, std::memory_order_relaxed );
+    inst->primaryCapabilities.store( InitMessage::Capabilities, std::memory_order_relaxed );
+    inst->primaryUid.store( uid, std::memory_order_relaxed );
+    strncpy( inst->primaryUser, username.constData(), 127 );
     inst->primaryUser[127] = '\0';
-    inst->checksum = blockChecksum();
+    endWrite( inst->sequence );
 
     instanceNumber = 0;
-}
+    registerInstance( InstanceSlot::Primary );
+    claimLegacyBlock();
+    countMetric( metrics().primaryStarts );
+
+    // The first heartbeat is published once the event loop runs, until then
+    // the instance can't be told apart from one still setting up
+    inst->primaryHeartbeat.store( 0, std::memory_order_relaxed );
+    QTimer::singleShot( 0, this, &SingleApplicationPrivate::publishHeartbeat );
+
+    // Secondary instances already running are not reported as started
+    for( const SingleApplication::InstanceInfo &info : instances() ) {
+        if( ! info.primary )
+            knownInstances.insert( info.id );
+    }
 
-void SingleApplicationPrivate::startSecondary()
-{
-    InstancesInfo* inst = static_cast <InstancesInfo*>( memory->data() );
-    inst->secondary += 1;
-    inst->checksum = blockChecksum();
-    instanceNumber = inst->secondary;
+    // Instances that crash can't release their slot, look for them once in a
+    // while
+    registryTimer = new QTimer( this );
+    registryTimer->setTimerType( Qt::VeryCoarseTimer );
+    registryTimer->setInterval( InstancesInfo::HeartbeatInterval );
+    QObject::connect(
+        registryTimer,
+        &QTimer::timeout,
+        this,
+        &SingleApplicationPrivate::slotReapInstances
+    );
+    QObject::connect(
+        registryTimer,
+        &QTimer::timeout,
+        this,
+        &SingleApplicationPrivate::publishHeartbeat
+    );
+    registryTimer->start();
+
+    // Claim the messages spooled while no primary instance was listening.
+    // Secondary instances only append under the memory lock, which is held
+    // here, so none are lost. They are replayed once the event loop runs or
+    // before the first connection is accepted, whichever comes first.
+    if( options & SingleApplication::Mode::SpoolMessages ) {
+        const QString spool = spoolPath();
+        if( QFile::exists( spool ) )
+            QFile::rename( spool, spool + QLatin1Char( '.' ) + QString::number( inst->generation.load( std::memory_order_relaxed ) ) );
+        spoolReplayPending = true;
+        QTimer::singleShot( 0, this, &SingleApplicationPrivate::replaySpool );
+    }
 }
 
-void SingleApplicationPrivate::connectToPrimary( int msecs, ConnectionType connectionType )
+/**
+ * @brief Attaches to the block of SingleApplication 3.x, creating it if
+ * needed, and locks it. A block that fails the checksum is initialised the
+ * same way 3.x does it. Without the block there is no 3.x primary to find.
+ */
+void SingleApplicationPrivate::lockLegacyBlock()
 {
-    // Connect to the Local Server of the Primary Instance if not already
-    // connected.
-    if( socket == nullptr ) {
-        socket = new QLocalSocket();
+    if( legacyLocked || legacyServerName.isEmpty() )
+        return;
+
+    if( legacyMemory == nullptr ) {
+        legacyMemory = new QSharedMemory( legacyServerName );
+        if( ! legacyMemory->create( sizeof( LegacyInstancesInfo ) ) &&
+            ( ! legacyMemory->attach() || legacyMemory->size() < static_cast<int>( sizeof( LegacyInstancesInfo ) ) ) ) {
+            delete legacyMemory;
+            legacyMemory = nullptr;
+            return;
+        }
     }
 
-    // If already connected - we are done;
-    if( socket->state() == QLocalSocket::ConnectedState )
-        return;
+    legacyMemory->lock();
+    legacyLocked = true;
 
-    // If not connect
-    if( socket->state() == QLocalSocket::UnconnectedState ||
-        socket->state() == QLocalSocket::ClosingState ) {
-        socket->connectToServer( blockServerName );
+    LegacyInstancesInfo* inst = static_cast<LegacyInstancesInfo*>( legacyMemory->data() );
+    if( inst->checksum != legacyChecksum() ) {
+        inst->primary = false;
+        inst->secondary = 0;
+        inst->primaryPid = -1;
+        inst->primaryUser[0] = '\0';
+        inst->checksum = legacyChecksum();
     }
+}
 
-    // Wait for being connected
-    if( socket->state() == QLocalSocket::ConnectingState ) {
-        socket->waitForConnected( msecs );
+void SingleApplicationPrivate::unlockLegacyBlock()
+{
+    if( ! legacyLocked )
+        return;
+
+    legacyMemory->unlock();
+    legacyLocked = false;
+
+    // Only the primary instance keeps the block
+    if( legacyServer == nullptr ) {
+        delete legacyMemory;
+        legacyMemory = nullptr;
     }
+}
 
-    // Initialisation message according to the SingleApplication protocol
-    if( socket->state() == QLocalSocket::ConnectedState ) {
-        // Notify the parent that a new instance had been started;
-        QByteArray initMsg;
-        QDataStream writeStream(&initMsg, QIODevice::WriteOnly);
+/**
+ * @brief Whether a primary instance built against 3.x owns the locked block
+ */
+bool SingleApplicationPrivate::legacyPrimaryAlive()
+{
+    if( ! legacyLocked )
+        return false;
 
-#if (QT_VERSION >= QT_VERSION_CHECK(5, 6, 0))
-        writeStream.setVersion(QDataStream::Qt_5_6);
-#endif
+    const LegacyInstancesInfo* inst = static_cast<const LegacyInstancesInfo*>( legacyMemory->constData() );
+    return inst->primary && isProcessAlive( inst->primaryPid );
+}
+
+/**
+ * @brief Registers the primary instance in the block of 3.x and listens on
+ * its server name, so that instances built against 3.x find it
+ */
+void SingleApplicationPrivate::claimLegacyBlock()
+{
+    lockLegacyBlock();
+    if( ! legacyLocked )
+        return;
 
-        writeStream << blockServerName.toLatin1();
-        writeStream << static_cast<quint8>(connectionType);
-        writeStream << instanceNumber;
-        quint16 checksum = qChecksum(initMsg.constData(), static_cast<quint32>(initMsg.length()));
-        writeStream << checksum;
+    QLocalServer::removeServer( legacyServerName );
+    legacyServer = new QLocalServer();
+    legacyServer->setSocketOptions( server->socketOptions() );
+    legacyServer->listen( legacyServerName );
+    QObject::connect(
+        legacyServer,
+        &QLocalServer::newConnection,
+        this,
+        &SingleApplicationPrivate::slotConnectionEstablished
+    );
 
-        // The header indicates the message length that follows
-        QByteArray header;
-        QDataStream headerStream(&header, QIODevice::WriteOnly);
+    LegacyInstancesInfo* inst = static_cast<LegacyInstancesInfo*>( legacyMemory->data() );
+    inst->primary = true;
+    inst->primaryPid = QCoreApplication::applicationPid();
+    strncpy( inst->primaryUser, legacyUser.constData(), 127 );
+    inst->primaryUser[127] = '\0';
+    inst->checksum = legacyChecksum();
 
-#if (QT_VERSION >= QT_VERSION_CHECK(5, 6, 0))
-        headerStream.setVersion(QDataStream::Qt_5_6);
-#endif
-        headerStream << static_cast <quint64>( initMsg.length() );
+    unlockLegacyBlock();
+}
 
-        socket->write( header );
-        socket->write( initMsg );
-        socket->flush();
-        socket->waitForBytesWritten( msecs );
+/**
+ * @brief Clears the block of 3.x unless another primary instance has taken
+ * it over since
+ */
+void SingleApplicationPrivate::releaseLegacyBlock()
+{
+    if( legacyMemory != nullptr ) {
+        legacyMemory->lock();
+        LegacyInstancesInfo* inst = static_cast<LegacyInstancesInfo*>( legacyMemory->data() );
+        if( inst->checksum == legacyChecksum() && inst->primaryPid == QCoreApplication::applicationPid() ) {
+            inst->primary = false;
+            inst->primaryPid = -1;
+            inst->primaryUser[0] = '\0';
+            inst->checksum = legacyChecksum();
+        }
+        legacyMemory->unlock();
+
+        delete legacyMemory;
+        legacyMemory = nullptr;
+    }
+
+    if( legacyServer != nullptr ) {
+        legacyServer->close();
+        delete legacyServer;
+        legacyServer = nullptr;
     }
 }
 
-quint16 SingleApplicationPrivate::blockChecksum()
+quint16 SingleApplicationPrivate::legacyChecksum()
 {
-    return qChecksum(
-       static_cast <const char *>( memory->data() ),
-       offsetof( InstancesInfo, checksum )
-   );
+    return qChecksum( static_cast<const char*>( legacyMemory->constData() ), offsetof( LegacyInstancesInfo, checksum ) );
 }
 
-qint64 SingleApplicationPrivate::primaryPid()
+/**
+ * @brief The journal of messages sent while no primary instance was listening
+ */
+QString SingleApplicationPrivate::spoolPath()
 {
-    qint64 pid;
+    QString directory = QStandardPaths::writableLocation( QStandardPaths::RuntimeLocation );
+    if( directory.isEmpty() )
+        directory = QDir::tempPath();
+    return directory + QStringLiteral( "/singleapplication-" ) + blockServerName + QStringLiteral( ".spool" );
+}
 
-    memory->lock();
-    InstancesInfo* inst = static_cast<InstancesInfo*>( memory->data() );
-    pid = inst->primaryPid;
-    memory->unlock();
+/**
+ * @brief Returns if this instance is connected to a primary instance which is
+ * still registered in the block
+ */
+bool SingleApplicationPrivate::isPrimaryListening()
+{
+    if( socket == nullptr || socket->state() != QLocalSocket::ConnectedState )
+        return false;
 
-    return pid;
+    // A primary instance built against 3.x is only registered in its own block
+    if( legacyPrimary )
+        return true;
+
+    const InstancesInfo* inst = static_cast<const InstancesInfo*>( memory->constData() );
+    return inst->primary.load( std::memory_order_relaxed );
 }
 
-QString SingleApplicationPrivate::primaryUser()
+/**
+ * @brief Appends a message the primary instance didn't take to the spool
+ * @param sequence The frame the message was sent in, 0 if it wasn't sent as
+ * an acknowledged frame
+ * @returns {bool} Whether the whole record was written
+ */
+bool SingleApplicationPrivate::spoolMessage( const QByteArray &message, quint32 sequence )
 {
-    QByteArray username;
+    // It is the next primary's now, don't send it again on reconnect
+    if( sequence != 0 )
+        unacknowledged.remove( sequence );
+
+    SpoolRecord record;
+    record.length = qToBigEndian<quint32>( static_cast<quint32>( message.size() ) );
+    record.instanceId = qToBigEndian<quint32>( instanceNumber );
+    record.checksum = qToBigEndian<quint32>( crc32c( message.constData(), static_cast<size_t>( message.size() ) ) );
 
+    QByteArray data;
+    data.reserve( static_cast<int>( sizeof( record ) ) + message.size() );
+    data.append( reinterpret_cast<const char*>( &record ), sizeof( record ) );
+    data.append( message );
+
+    // One write per record, so records of concurrent instances don't interleave
     memory->lock();
-    InstancesInfo* inst = static_cast<InstancesInfo*>( memory->data() );
-    username = inst->primaryUser;
+    QFile spool( spoolPath() );
+    const bool written = spool.open( QIODevice::WriteOnly | QIODevice::Append | QIODevice::Unbuffered ) &&
+                         spool.write( data ) == data.size();
     memory->unlock();
 
-    return QString::fromUtf8( username );
+    if( ! written )
+        qWarning() << "SingleApplication: Unable to spool a message:" << spool.errorString();
+    return written;
 }
 
 /**
- * @brief Executed when a connection has been made to the LocalServer
+ * @brief Delivers the spooled messages claimed by startPrimary(), along with
+ * any left behind by a primary instance that died while replaying them
  */
-void SingleApplicationPrivate::slotConnectionEstablished()
+void SingleApplicationPrivate::replaySpool()
 {
-    QLocalSocket *nextConnSocket = server->nextPendingConnection();
-    connectionMap.insert(nextConnSocket, ConnectionInfo());
-
-    QObject::connect(nextConnSocket, &QLocalSocket::aboutToClose,
-        nextConnSocket, [nextConnSocket, this]() {
-            if (!connectionMap.contains( nextConnSocket ))
-                return;
-            const auto &info = connectionMap[nextConnSocket];
-            Q_EMIT this->slotClientConnectionClosed( nextConnSocket, info.instanceId );
-        }
-    );
-
-    QObject::connect(nextConnSocket, &QLocalSocket::disconnected,
-        nextConnSocket, [nextConnSocket, this](){
-            if (!connectionMap.contains( nextConnSocket ))
-                return;
-            connectionMap.remove(nextConnSocket);
-            nextConnSocket->deleteLater();
+    if( ! spoolReplayPending )
+        return;
+    spoolReplayPending = false;
+
+    const QFileInfo spool( spoolPath() );
+    const QDir directory = spool.dir();
+    const QStringList claimed = directory.entryList( QStringList() << spool.fileName() + QStringLiteral( ".*" ), QDir::Files, QDir::Name );
+    for( const QString &name : claimed ) {
+        QFile file( directory.filePath( name ) );
+        if( ! file.open( QIODevice::ReadOnly ) )
+            continue;
+
+        const qint64 size = file.size();
+        const uchar *data = size > 0 ? file.map( 0, size ) : nullptr;
+
+        // Not every file system can map files. A spool that can't be read
+        // either is left for the next replay.
+        QByteArray contents;
+        if( data == nullptr && size > 0 ) {
+            contents = file.readAll();
+            if( contents.size() != size ) {
+                qWarning() << "SingleApplication: Unable to read the spool:" << file.errorString();
+                continue;
+            }
+            data = reinterpret_cast<const uchar*>( contents.constData() );
         }
-    );
 
-    QObject::connect(nextConnSocket, &QLocalSocket::readyRead,
-        nextConnSocket, [nextConnSocket, this]() {
-            if (!connectionMap.contains( nextConnSocket ))
-                return;
-            auto &info = connectionMap[nextConnSocket];
-            switch(info.stage) {
-            case StageHeader:
-                readInitMessageHeader(nextConnSocket);
-                break;
-            case StageBody:
-                readInitMessageBody(nextConnSocket);
+        qint64 offset = 0;
+        while( data != nullptr && size - offset >= static_cast<qint64>( sizeof( SpoolRecord ) ) ) {
+            SpoolRecord record;
+            memcpy( &record, data + offset, sizeof( record ) );
+            const quint32 length = qFromBigEndian( record.length );
+            if( length > size - offset - static_cast<qint64>( sizeof( record ) ) )
                 break;
-            case StageConnected:
-                Q_EMIT this->slotDataAvailable( nextConnSocket, info.instanceId );
-                break;
-            default:
+
+            const char *message = reinterpret_cast<const char*>( data + offset + sizeof( record ) );
+            if( crc32c( message, length ) != qFromBigEndian( record.checksum ) )
                 break;
-            };
+            offset += static_cast<qint64>( sizeof( record ) ) + length;
+
+            deliverMessage( qFromBigEndian( record.instanceId ), -1, QByteArray( message, static_cast<int>( length ) ) );
         }
-    );
-}
 
-void SingleApplicationPrivate::readInitMessageHeader( QLocalSocket *sock )
-{
-    if (!connectionMap.contains( sock )) {
-        return;
+        if( offset < size )
+            qWarning() << "SingleApplication: Dropped" << size - offset << "bytes of a torn spool record.";
+        file.remove();
     }
+}
 
-    if( sock->bytesAvailable() < ( qint64 )sizeof( quint64 ) ) {
+void SingleApplicationPrivate::startSecondary()
+{
+    InstancesInfo* inst = static_cast <InstancesInfo*>( memory->data() );
+    beginWrite( inst->sequence );
+    instanceNumber = inst->secondary.load( std::memory_order_relaxed ) + 1;
+    inst->secondary.store( instanceNumber, std::memory_order_relaxed );
+    endWrite( inst->sequence );
+
+    registerInstance( InstanceSlot::Secondary );
+    countMetric( metrics().secondaryStarts );
+    recordEvent( SingleApplication::IpcEvent::BecameSecondary, 0, instanceNumber );
+}
+
+/**
+ * @brief Connects to the primary instance unless already connected and sends
+ * the message. A new connection carries the handshake and the message in a
+ * single write, so the primary takes in both with one wakeup.
+ * @returns {bool} Whether everything was written to the socket
+ */
+bool SingleApplicationPrivate::connectToPrimary( int msecs, ConnectionType connectionType, const QByteArray &message )
+{
+    // Connect to the Local Server of the Primary Instance if not already
+    // connected.
+    if( socket == nullptr ) {
+        socket = new QLocalSocket();
+    }
+
+    // If already connected only the message is left to send
+    if( socket->state() == QLocalSocket::ConnectedState ) {
+        readInitReply();
+        if( message.isEmpty() )
+            return true;
+        socket->write( message );
+        socket->flush();
+        return socket->bytesToWrite() == 0 || socket->waitForBytesWritten( msecs );
+    }
+
+    // Don't wait on a primary instance that is blocked. The kernel still
+    // queues the connection and the data written to it. A primary instance
+    // built against 3.x publishes no heartbeat.
+    if( ! legacyPrimary && ! isPrimaryResponsive() )
+        msecs = 0;
+
+    // If not connect
+    if( socket->state() == QLocalSocket::UnconnectedState ||
+        socket->state() == QLocalSocket::ClosingState ) {
+        socket->connectToServer( legacyPrimary ? legacyServerName : blockServerName );
+    }
+
+    // Wait for being connected
+    if( socket->state() == QLocalSocket::ConnectingState ) {
+        socket->waitForConnected( msecs );
+    }
+
+    if( socket->state() != QLocalSocket::ConnectedState ) {
+        countMetric( metrics().connectionsFailed );
+        recordEvent( SingleApplication::IpcEvent::ConnectionFailed, connectionType );
+        return false;
+    }
+
+    countMetric( metrics().connectionsMade );
+    recordEvent( SingleApplication::IpcEvent::ConnectedToPrimary, connectionType );
+
+    // Notify the parent that a new instance had been started. A primary
+    // instance built against 3.x only understands the QDataStream handshake
+    // and never replies.
+    negotiateWithPrimary();
+    if( negotiatedVersion == 0 ) {
+        initReplyRead = true;
+        socket->write( buildLegacyInitMessage( connectionType ) + message );
+    } else {
+        initReplyRead = false;
+
+        // The launch details only matter to the primary if it reports the launch
+        QByteArray extension;
+        if( options & SingleApplication::Mode::ForwardLaunchDetails &&
+            negotiatedCapabilities & InitMessage::LaunchDetails &&
+            connectionType != Reconnect )
+            extension = buildLaunchDetails();
+
+        QVarLengthArray<char, 4096> frame( static_cast<int>( sizeof( InitMessage ) ) + extension.size() + message.size() );
+        char *data = frame.data();
+        memcpy( data, &buildInitMessage( connectionType, static_cast<quint32>( extension.size() ) ), sizeof( InitMessage ) );
+        data += sizeof( InitMessage );
+        memcpy( data, extension.constData(), static_cast<size_t>( extension.size() ) );
+        data += extension.size();
+        memcpy( data, message.constData(), static_cast<size_t>( message.size() ) );
+#ifdef SINGLEAPPLICATION_FAULT_INJECTION
+        // Die with only half of the handshake on the wire
+        if( isKillPoint( "sendHandshake" ) ) {
+            socket->write( frame.constData(), sizeof( InitMessage ) / 2 );
+            socket->waitForBytesWritten( msecs );
+            killPoint( "sendHandshake" );
+        }
+#endif
+        socket->write( frame.constData(), frame.size() );
+    }
+
+    socket->flush();
+    return socket->bytesToWrite() == 0 || socket->waitForBytesWritten( msecs );
+}
+
+/**
+ * @brief Picks the protocol version and capabilities to offer from what the
+ * primary published in the block, so that no round trip is needed before the
+ * handshake. The reply of the primary has the final say.
+ */
+void SingleApplicationPrivate::negotiateWithPrimary()
+{
+    if( legacyPrimary ) {
+        negotiatedVersion = 0;
+        negotiatedCapabilities = InitMessage::NoCapabilities;
         return;
     }
 
-    QDataStream headerStream( sock );
+    const InstancesInfo* inst = static_cast<const InstancesInfo*>( memory->constData() );
+
+    quint16 version;
+    quint32 capabilities;
+    quint32 sequence;
+    do {
+        sequence = beginRead( inst->sequence );
+        version = inst->primaryVersion.load( std::memory_order_relaxed );
+        capabilities = inst->primaryCapabilities.load( std::memory_order_relaxed );
+    } while( ! endRead( inst->sequence, sequence ) );
+
+    // A primary that is still starting up has published nothing yet
+    negotiatedVersion = version == 0 ? static_cast<quint16>( InitMessage::Version ) : qMin<quint16>( version, InitMessage::Version );
+    negotiatedCapabilities = capabilities & InitMessage::Capabilities;
+    if( ! ( options & SingleApplication::Mode::AcknowledgeMessages ) )
+        negotiatedCapabilities &= ~InitMessage::Acknowledgements;
+}
+
+/**
+ * @brief Builds the initialisation message according to the SingleApplication
+ * protocol. The fields that never change are filled in once per process.
+ */
+const InitMessage &SingleApplicationPrivate::buildInitMessage( ConnectionType connectionType, quint32 extensionLength )
+{
+    if( initMessage.magic == 0 ) {
+        initMessage.length = qToBigEndian<quint64>( sizeof( InitMessage ) - sizeof( quint64 ) );
+        initMessage.magic = qToBigEndian<quint32>( InitMessage::Magic );
+        initMessage.keyHash = qToBigEndian<quint64>( blockKeyHash );
+        initMessage.launchTime = qToBigEndian<qint64>( launchTime() );
+    }
+
+    initMessage.version = qToBigEndian<quint16>( negotiatedVersion );
+    initMessage.capabilities = qToBigEndian<quint32>( negotiatedCapabilities );
+    initMessage.type = static_cast<quint8>( connectionType );
+    initMessage.instanceId = qToBigEndian<quint32>( instanceNumber );
+    initMessage.extensionLength = qToBigEndian<quint32>( extensionLength );
+    initMessage.checksum = qToBigEndian<quint32>( crc32c( reinterpret_cast<const char*>( &initMessage ), offsetof( InitMessage, checksum ) ) );
+
+    return initMessage;
+}
+
+/**
+ * @brief Encodes the arguments, the working directory and the startup
+ * notification variables of this process for the handshake extension. They
+ * don't change, so this is done once per process.
+ */
+const QByteArray &SingleApplicationPrivate::buildLaunchDetails()
+{
+    if( ! launchDetails.isEmpty() )
+        return launchDetails;
+
+    const auto appendRecord = [this]( LaunchDetailsRecord tag, const QByteArray &value ) {
+        char header[1 + sizeof( quint32 )];
+        header[0] = static_cast<char>( tag );
+        qToBigEndian<quint32>( static_cast<quint32>( value.size() ), header + 1 );
+        launchDetails.append( header, sizeof( header ) );
+        launchDetails.append( value );
+    };
+
+    for( const QString &argument : QCoreApplication::arguments() )
+        appendRecord( ArgumentRecord, argument.toUtf8() );
+    appendRecord( WorkingDirectoryRecord, QDir::currentPath().toUtf8() );
+    for( int i = 0; i < startupVariableCount; ++i ) {
+        if( ! startupVariables[i].isNull() )
+            appendRecord( EnvironmentRecord, QByteArray( startupVariableNames[i] ) + '=' + startupVariables[i] );
+    }
+
+    if( static_cast<quint32>( launchDetails.size() ) > MaxInitExtensionLength ) {
+        qWarning() << "SingleApplication: The launch details are too large to be sent to the primary instance.";
+        launchDetails.clear();
+    }
+
+    return launchDetails;
+}
+
+/**
+ * @brief Decodes the launch details of a handshake extension
+ * @returns {bool} Whether every record was complete
+ */
+bool SingleApplicationPrivate::parseLaunchDetails( const QByteArray &extension, SingleApplication::LaunchInfo &launch )
+{
+    const char *data = extension.constData();
+    const char *end = data + extension.size();
+    while( data != end ) {
+        if( end - data < static_cast<qint64>( 1 + sizeof( quint32 ) ) )
+            return false;
+
+        const quint8 tag = static_cast<quint8>( data[0] );
+        const quint32 length = qFromBigEndian<quint32>( data + 1 );
+        data += 1 + sizeof( quint32 );
+        if( length > static_cast<quint64>( end - data ) )
+            return false;
+
+        const QString value = QString::fromUtf8( data, static_cast<int>( length ) );
+        data += length;
+
+        switch( tag ) {
+        case ArgumentRecord:
+            launch.arguments.append( value );
+            break;
+        case WorkingDirectoryRecord:
+            launch.workingDirectory = value;
+            break;
+        case EnvironmentRecord: {
+            const int separator = value.indexOf( QLatin1Char( '=' ) );
+            if( separator > 0 )
+                launch.environment.insert( value.left( separator ), value.mid( separator + 1 ) );
+            break;
+        }
+        default:
+            // Added by a later version
+            break;
+        }
+    }
+
+    return true;
+}
 
-#if (QT_VERSION >= QT_VERSION_CHECK(5, 6, 0))
+/**
+ * @brief Builds the QDataStream handshake of SingleApplication 3.x
+ */
+QByteArray SingleApplicationPrivate::buildLegacyInitMessage( ConnectionType connectionType )
+{
+    QByteArray initMsg;
+    QDataStream writeStream( &initMsg, QIODevice::WriteOnly );
+    writeStream.setVersion( QDataStream::Qt_5_6 );
+
+    writeStream << legacyServerName.toLatin1();
+    writeStream << static_cast<quint8>( connectionType );
+    writeStream << instanceNumber;
+    writeStream << quint16( qChecksum( initMsg.constData(), static_cast<quint32>( initMsg.length() ) ) );
+
+    // The header indicates the message length that follows
+    QByteArray header;
+    QDataStream headerStream( &header, QIODevice::WriteOnly );
     headerStream.setVersion( QDataStream::Qt_5_6 );
+    headerStream << static_cast<quint64>( initMsg.length() );
+
+    return header + initMsg;
+}
+
+/**
+ * @brief Takes in the reply of the primary to the handshake once it has
+ * arrived, without waiting for it
+ */
+void SingleApplicationPrivate::readInitReply()
+{
+    if( initReplyRead )
+        return;
+
+    if( socket->bytesAvailable() < static_cast<qint64>( sizeof( InitReply ) ) )
+        socket->waitForReadyRead( 0 );
+    if( socket->bytesAvailable() < static_cast<qint64>( sizeof( InitReply ) ) )
+        return;
+
+    InitReply reply;
+    socket->read( reinterpret_cast<char*>( &reply ), sizeof( reply ) );
+    initReplyRead = true;
+
+    if( qFromBigEndian( reply.magic ) != InitMessage::Magic ) {
+        qWarning() << "SingleApplication: Unexpected reply to the handshake from the primary instance.";
+        return;
+    }
+
+    negotiatedVersion = qFromBigEndian( reply.version );
+    negotiatedCapabilities = qFromBigEndian( reply.capabilities ) & InitMessage::Capabilities;
+}
+
+/**
+ * @brief Sends a message as a frame which the primary acknowledges. Frames
+ * that were not acknowledged are sent again on a new connection, the primary
+ * drops those it has already handled.
+ * @param sequence Set to the frame the message is waiting in to be
+ * acknowledged, 0 if it was sent without a frame
+ * @returns {bool} Whether the primary acknowledged the message in time
+ */
+bool SingleApplicationPrivate::sendAcknowledged( const QByteArray &message, int msecs, quint32 &sequence )
+{
+    MessageFrame header;
+    header.sequence = qToBigEndian<quint32>( ++messageSequence );
+    header.length = qToBigEndian<quint32>( static_cast<quint32>( message.size() ) );
+    header.checksum = qToBigEndian<quint32>( crc32c( message.constData(), static_cast<size_t>( message.size() ) ) );
+
+    QByteArray frame;
+    frame.reserve( static_cast<int>( sizeof( header ) ) + message.size() );
+    frame.append( reinterpret_cast<const char*>( &header ), sizeof( header ) );
+    frame.append( message );
+
+    sequence = messageSequence;
+    unacknowledged.insert( sequence, frame );
+
+    QElapsedTimer timer;
+    timer.start();
+    for( int attempt = 0; attempt < 2; ++attempt ) {
+        const int remaining = qMax( 0, msecs - static_cast<int>( timer.elapsed() ) );
+        bool written;
+        if( socket != nullptr && socket->state() == QLocalSocket::ConnectedState ) {
+            // Frames only go to a primary that asked for them
+            if( ! ( negotiatedCapabilities & InitMessage::Acknowledgements ) ) {
+                unacknowledged.remove( sequence );
+                sequence = 0;
+                return connectToPrimary( remaining, Reconnect, message );
+            }
+            written = connectToPrimary( remaining, Reconnect, frame );
+        } else {
+            negotiateWithPrimary();
+            if( ! ( negotiatedCapabilities & InitMessage::Acknowledgements ) ) {
+                unacknowledged.remove( sequence );
+                sequence = 0;
+                return connectToPrimary( remaining, Reconnect, message );
+            }
+
+            // A new connection starts with everything not acknowledged yet
+            QByteArray frames;
+            for( const QByteArray &pending : unacknowledged )
+                frames.append( pending );
+            written = connectToPrimary( remaining, Reconnect, frames );
+        }
+
+        if( written && waitForAcknowledgement( sequence, qMax( 0, msecs - static_cast<int>( timer.elapsed() ) ) ) )
+            return true;
+
+        // Only a lost connection is worth another attempt, a late
+        // acknowledgement is still taken in by the next call
+        if( socket->state() == QLocalSocket::ConnectedState )
+            return false;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Reads acknowledgements until the frame with the given sequence is
+ * acknowledged, the connection is lost or the time is up
+ */
+bool SingleApplicationPrivate::waitForAcknowledgement( quint32 sequence, int msecs )
+{
+    QElapsedTimer timer;
+    timer.start();
+    Q_FOREVER {
+        // The reply to the handshake precedes the acknowledgements
+        readInitReply();
+        while( initReplyRead && socket->bytesAvailable() >= static_cast<qint64>( sizeof( quint32 ) ) ) {
+            uchar acknowledgement[sizeof( quint32 )];
+            socket->read( reinterpret_cast<char*>( acknowledgement ), sizeof( acknowledgement ) );
+            const quint32 acknowledged = qFromBigEndian<quint32>( acknowledgement );
+            while( ! unacknowledged.isEmpty() && unacknowledged.firstKey() <= acknowledged )
+                unacknowledged.erase( unacknowledged.begin() );
+        }
+
+        if( ! unacknowledged.contains( sequence ) )
+            return true;
+
+        const int remaining = msecs - static_cast<int>( timer.elapsed() );
+        if( remaining <= 0 || socket->state() != QLocalSocket::ConnectedState )
+            return false;
+        socket->waitForReadyRead( remaining );
+    }
+}
+
+/**
+ * @brief Starts a seqlock protected update. Writers of the same sequence must
+ * already be serialised, by the memory lock or by owning an instance slot.
+ */
+void SingleApplicationPrivate::beginWrite( std::atomic<quint32> &sequence )
+{
+    sequence.fetch_add( 1, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_release );
+}
+
+void SingleApplicationPrivate::endWrite( std::atomic<quint32> &sequence )
+{
+    sequence.fetch_add( 1, std::memory_order_release );
+}
+
+/**
+ * @brief Starts an update of data whose last writer may have died half way
+ * through. The sequence is forced odd rather than incremented, so it ends up
+ * even again and readers racing with the recovery notice that it moved. The
+ * caller must own the data.
+ */
+void SingleApplicationPrivate::restartWrite( std::atomic<quint32> &sequence )
+{
+    sequence.store( sequence.load( std::memory_order_relaxed ) | 1, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_release );
+}
+
+/**
+ * @brief Returns the sequence a lock-free read starts at
+ */
+quint32 SingleApplicationPrivate::beginRead( const std::atomic<quint32> &sequence )
+{
+    quint32 value = sequence.load( std::memory_order_acquire );
+
+    // Writers only keep the sequence odd for a few stores. If it stays odd
+    // the writer has died and the next instance to start will recover the
+    // block, so don't spin on it forever.
+    for( int spins = 0; ( value & 1 ) && spins < 1000; ++spins ) {
+        QThread::yieldCurrentThread();
+        value = sequence.load( std::memory_order_acquire );
+    }
+
+    return value;
+}
+
+/**
+ * @brief Returns whether the data read since beginRead() is consistent
+ */
+bool SingleApplicationPrivate::endRead( const std::atomic<quint32> &sequence, quint32 value )
+{
+    std::atomic_thread_fence( std::memory_order_acquire );
+    return sequence.load( std::memory_order_relaxed ) == value;
+}
+
+/**
+ * @brief Returns a timestamp from a clock that is consistent across processes
+ * and does not jump with the wall clock
+ */
+qint64 SingleApplicationPrivate::monotonicMSecs()
+{
+    QElapsedTimer timer;
+    timer.start();
+    return timer.msecsSinceReference();
+}
+
+/**
+ * @brief Lets other instances know that the event loop of the primary instance
+ * is still running. Called from the IPC path and the coarse registry timer.
+ */
+void SingleApplicationPrivate::publishHeartbeat()
+{
+    InstancesInfo* inst = static_cast<InstancesInfo*>( memory->data() );
+    inst->primaryHeartbeat.store( monotonicMSecs(), std::memory_order_relaxed );
+}
+
+bool SingleApplicationPrivate::isPrimaryResponsive()
+{
+    if( server != nullptr )
+        return true;
+
+    const InstancesInfo* inst = static_cast<const InstancesInfo*>( memory->constData() );
+    if( ! inst->primary.load( std::memory_order_relaxed ) )
+        return false;
+
+    // A primary instance which hasn't reached its event loop yet is not hung
+    const qint64 heartbeat = inst->primaryHeartbeat.load( std::memory_order_relaxed );
+    return heartbeat == 0 || monotonicMSecs() - heartbeat < InstancesInfo::HeartbeatTimeout;
+}
+
+/**
+ * @brief Returns a nanosecond timestamp from a monotonic clock. On the
+ * supported platforms it is shared by all processes, which lets traces of
+ * several instances line up.
+ */
+qint64 SingleApplicationPrivate::steadyNSecs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+/**
+ * @brief Returns when the process was loaded, as a steadyNSecs() timestamp
+ */
+qint64 SingleApplicationPrivate::launchTime()
+{
+    return processLaunchTime;
+}
+
+/**
+ * @brief Records a phase of the constructor which started at start and ends now
+ */
+void SingleApplicationPrivate::recordPhase( const char *name, qint64 start )
+{
+    SingleApplication::StartupPhase phase;
+    phase.name = QLatin1String( name );
+    phase.start = start - startupBegin;
+    phase.duration = steadyNSecs() - start;
+    startupPhases.append( phase );
+}
+
+/**
+ * @brief Writes the startup phases as a Chrome trace to the directory named by
+ * the SINGLEAPPLICATION_TRACE environment variable, if it is set
+ */
+void SingleApplicationPrivate::writeStartupTrace()
+{
+    const QByteArray traceDir = qgetenv( "SINGLEAPPLICATION_TRACE" );
+    if( traceDir.isEmpty() )
+        return;
+
+    const qint64 pid = QCoreApplication::applicationPid();
+    QJsonArray events;
+    for( const SingleApplication::StartupPhase &phase : startupPhases ) {
+        QJsonObject event;
+        event[QStringLiteral( "name" )] = phase.name;
+        event[QStringLiteral( "cat" )] = QStringLiteral( "SingleApplication" );
+        event[QStringLiteral( "ph" )] = QStringLiteral( "X" );
+        event[QStringLiteral( "ts" )] = ( startupBegin + phase.start ) / 1000.0;
+        event[QStringLiteral( "dur" )] = phase.duration / 1000.0;
+        event[QStringLiteral( "pid" )] = static_cast<double>( pid );
+        event[QStringLiteral( "tid" )] = 0;
+        events.append( event );
+    }
+
+    QJsonObject trace;
+    trace[QStringLiteral( "traceEvents" )] = events;
+    trace[QStringLiteral( "displayTimeUnit" )] = QStringLiteral( "ns" );
+
+    QFile file( QDir( QFile::decodeName( traceDir ) ).filePath( QStringLiteral( "singleapplication-%1.json" ).arg( pid ) ) );
+    if( ! file.open( QIODevice::WriteOnly | QIODevice::Truncate ) ) {
+        qWarning() << "SingleApplication: Unable to write the startup trace:" << file.errorString();
+        return;
+    }
+    file.write( QJsonDocument( trace ).toJson( QJsonDocument::Compact ) );
+}
+
+IpcMetrics &SingleApplicationPrivate::metrics()
+{
+    return static_cast<InstancesInfo*>( memory->data() )->metrics;
+}
+
+void SingleApplicationPrivate::recordLockWait( qint64 nsecs )
+{
+    int bucket = 0;
+    for( qint64 usecs = nsecs / 1000; usecs > 0 && bucket < IpcMetrics::LockWaitBuckets - 1; usecs >>= 1 )
+        ++bucket;
+
+    metrics().lockWait.buckets[bucket].fetch_add( 1, std::memory_order_relaxed );
+    recordEvent( SingleApplication::IpcEvent::LockWaited, 0, static_cast<quint64>( nsecs ) );
+}
+
+/**
+ * @brief Appends an event to the flight recorder. Costs an atomic increment
+ * and a few relaxed stores, cheap enough to stay always on.
+ */
+void SingleApplicationPrivate::recordEvent( SingleApplication::IpcEvent::Type type, quint32 detail, quint64 value )
+{
+    FlightRecorder &recorder = static_cast<InstancesInfo*>( memory->data() )->recorder;
+    const quint64 index = recorder.head.fetch_add( 1, std::memory_order_relaxed );
+    FlightEvent &event = recorder.events[index % FlightRecorder::Capacity];
+
+    event.sequence.store( 2 * index + 1, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_release );
+    event.time.store( steadyNSecs(), std::memory_order_relaxed );
+    event.pid.store( QCoreApplication::applicationPid(), std::memory_order_relaxed );
+    event.value.store( value, std::memory_order_relaxed );
+    event.detail.store( detail, std::memory_order_relaxed );
+    event.type.store( type, std::memory_order_relaxed );
+    event.sequence.store( 2 * index + 2, std::memory_order_release );
+}
+
+/**
+ * @brief Dumps the flight recorder to SINGLEAPPLICATION_CRASH_DUMP on a crash
+ */
+void SingleApplicationPrivate::installCrashDump()
+{
+#ifdef Q_OS_UNIX
+    const QByteArray directory = qgetenv( "SINGLEAPPLICATION_CRASH_DUMP" );
+    if( directory.isEmpty() || crashDumpRecorder != nullptr )
+        return;
+
+    const QString fileName = QStringLiteral( "singleapplication-%1.events" ).arg( QCoreApplication::applicationPid() );
+    const QByteArray path = QFile::encodeName( QDir( QFile::decodeName( directory ) ).filePath( fileName ) );
+    if( path.size() >= static_cast<int>( sizeof( crashDumpPath ) ) ) {
+        qWarning() << "SingleApplication: SINGLEAPPLICATION_CRASH_DUMP is too long.";
+        return;
+    }
+    memcpy( crashDumpPath, path.constData(), static_cast<size_t>( path.size() ) + 1 );
+    crashDumpRecorder = &static_cast<const InstancesInfo*>( memory->constData() )->recorder;
+
+    struct sigaction action;
+    memset( &action, 0, sizeof( action ) );
+    action.sa_handler = crashDumpHandler;
+    sigemptyset( &action.sa_mask );
+    for( int i = 0; i < crashDumpSignalCount; ++i )
+        sigaction( crashDumpSignals[i], &action, &previousCrashActions[i] );
 #endif
+}
 
-    // Read the header to know the message length
-    quint64 msgLen = 0;
-    headerStream >> msgLen;
-    ConnectionInfo &info = connectionMap[sock];
-    info.stage = StageBody;
-    info.msgLen = msgLen;
+/**
+ * @brief Restores the signal handlers replaced by installCrashDump()
+ */
+void SingleApplicationPrivate::removeCrashDump()
+{
+#ifdef Q_OS_UNIX
+    if( crashDumpRecorder == &static_cast<const InstancesInfo*>( memory->constData() )->recorder )
+        restoreCrashHandlers();
+#endif
+}
+
+/**
+ * @brief Decodes the events of a flight recorder, oldest first. Entries that
+ * are being written or were overwritten while reading are skipped.
+ */
+QList<SingleApplication::IpcEvent> SingleApplicationPrivate::readEvents( const FlightRecorder &recorder )
+{
+    QList<SingleApplication::IpcEvent> list;
+
+    const quint64 head = recorder.head.load( std::memory_order_acquire );
+    const quint64 first = head > FlightRecorder::Capacity ? head - FlightRecorder::Capacity : 0;
+
+    for( quint64 index = first; index < head; ++index ) {
+        const FlightEvent &entry = recorder.events[index % FlightRecorder::Capacity];
+        const quint64 sequence = entry.sequence.load( std::memory_order_acquire );
+        if( sequence != 2 * index + 2 )
+            continue;
 
-    if ( sock->bytesAvailable() >= (qint64) msgLen ) {
-        readInitMessageBody( sock );
+        SingleApplication::IpcEvent event;
+        event.time = entry.time.load( std::memory_order_relaxed );
+        event.pid = entry.pid.load( std::memory_order_relaxed );
+        event.value = entry.value.load( std::memory_order_relaxed );
+        event.detail = entry.detail.load( std::memory_order_relaxed );
+        event.type = static_cast<SingleApplication::IpcEvent::Type>( entry.type.load( std::memory_order_relaxed ) );
+
+        std::atomic_thread_fence( std::memory_order_acquire );
+        if( entry.sequence.load( std::memory_order_relaxed ) != sequence )
+            continue;
+
+        list.append( event );
     }
+
+    return list;
 }
 
-void SingleApplicationPrivate::readInitMessageBody( QLocalSocket *sock )
+qint64 SingleApplicationPrivate::primaryPid()
 {
-    Q_Q(SingleApplication);
+    const InstancesInfo* inst = static_cast<const InstancesInfo*>( memory->constData() );
+
+    qint64 pid;
+    quint32 sequence;
+    do {
+        sequence = beginRead( inst->sequence );
+        pid = inst->primaryPid.load( std::memory_order_relaxed );
+    } while( ! endRead( inst->sequence, sequence ) );
+
+    return pid;
+}
+
+QString SingleApplicationPrivate::primaryUser()
+{
+    const InstancesInfo* inst = static_cast<const InstancesInfo*>( memory->constData() );
+
+    char username[sizeof( inst->primaryUser )];
+    qint64 uid;
+    quint32 sequence;
+    do {
+        sequence = beginRead( inst->sequence );
+        uid = inst->primaryUid.load( std::memory_order_relaxed );
+        memcpy( username, inst->primaryUser, sizeof( username ) );
+    } while( ! endRead( inst->sequence, sequence ) );
+    username[sizeof( username ) - 1] = '\0';
+
+    if( uid >= 0 )
+        return usernameForUid( uid );
+    return QString::fromUtf8( username );
+}
+
+/**
+ * @brief Claims a free slot of the instance registry for this instance. The
+ * memory lock must be held.
+ */
+void SingleApplicationPrivate::registerInstance( InstanceSlot::State state )
+{
+    InstancesInfo* inst = static_cast<InstancesInfo*>( memory->data() );
+    const quint64 id = ( static_cast<quint64>( inst->generation.load( std::memory_order_relaxed ) ) << 32 ) | instanceNumber;
+
+    for( int attempt = 0; attempt < 2; ++attempt ) {
+        for( InstanceSlot &slot : inst->instances ) {
+            // A slot still registering belongs to an instance that died with
+            // the lock held
+            quint32 expected = InstanceSlot::Free;
+            if( ! slot.state.compare_exchange_strong( expected, InstanceSlot::Registering, std::memory_order_acquire ) &&
+                expected != InstanceSlot::Registering )
+                continue;
+
+            restartWrite( slot.sequence );
+            slot.pid.store( QCoreApplication::applicationPid(), std::memory_order_relaxed );
+            slot.id.store( id, std::memory_order_relaxed );
+            slot.startTime.store( QDateTime::currentMSecsSinceEpoch(), std::memory_order_relaxed );
+            // Reapers read the pid and id after claiming the state
+            slot.state.store( state, std::memory_order_release );
+            endWrite( slot.sequence );
+
+            instanceSlot = &slot;
+            return;
+        }
+
+        // The registry is full, make room by reaping instances that crashed
+        if( ! reapDeadInstances() )
+            break;
+    }
+
+    qWarning() << "SingleApplication: The instance registry is full, this instance will not be listed.";
+}
+
+void SingleApplicationPrivate::unregisterInstance()
+{
+    if( instanceSlot == nullptr )
+        return;
+
+    releaseSlot( instanceSlot );
+    instanceSlot = nullptr;
+}
+
+/**
+ * @brief Frees a slot of the instance registry. The caller must own the slot.
+ */
+void SingleApplicationPrivate::releaseSlot( InstanceSlot *slot )
+{
+    // A dead owner may have left the sequence odd
+    restartWrite( slot->sequence );
+    slot->pid.store( -1, std::memory_order_relaxed );
+    slot->id.store( 0, std::memory_order_relaxed );
+    slot->startTime.store( 0, std::memory_order_relaxed );
+    endWrite( slot->sequence );
+
+    // Only hand the slot over once its sequence is no longer being written
+    slot->state.store( InstanceSlot::Free, std::memory_order_release );
+}
+
+/**
+ * @brief Frees the slots of instances whose process no longer exists
+ * @returns {bool} Whether any slot has been freed
+ */
+bool SingleApplicationPrivate::reapDeadInstances()
+{
+    InstancesInfo* inst = static_cast<InstancesInfo*>( memory->data() );
+    bool reaped = false;
+
+    for( InstanceSlot &slot : inst->instances ) {
+        quint32 state = slot.state.load( std::memory_order_acquire );
+        if( state != InstanceSlot::Primary && state != InstanceSlot::Secondary )
+            continue;
+
+        const qint64 pid = slot.pid.load( std::memory_order_relaxed );
+        const quint64 id = slot.id.load( std::memory_order_relaxed );
+        if( isProcessAlive( pid ) )
+            continue;
+
+        // Somebody else may be reaping the same slot
+        if( ! slot.state.compare_exchange_strong( state, InstanceSlot::Claimed, std::memory_order_acquire ) )
+            continue;
+
+        // The slot may have been released and claimed by a live instance
+        // since it was read, in which case it is handed back to its owner
+        if( slot.pid.load( std::memory_order_relaxed ) != pid || slot.id.load( std::memory_order_relaxed ) != id ) {
+            quint32 claimed = InstanceSlot::Claimed;
+            slot.state.compare_exchange_strong( claimed, state, std::memory_order_release );
+            continue;
+        }
+
+        releaseSlot( &slot );
+        reaped = true;
+    }
+
+    return reaped;
+}
+
+bool SingleApplicationPrivate::isProcessAlive( qint64 pid )
+{
+    if( pid <= 0 )
+        return false;
+
+#if defined(Q_OS_UNIX)
+    // EPERM means that the process exists but belongs to another user
+    return ::kill( static_cast<pid_t>( pid ), 0 ) == 0 || errno != ESRCH;
+#elif defined(Q_OS_WIN)
+    HANDLE process = OpenProcess( SYNCHRONIZE, FALSE, static_cast<DWORD>( pid ) );
+    if( process == nullptr )
+        return GetLastError() != ERROR_INVALID_PARAMETER;
+    const bool alive = WaitForSingleObject( process, 0 ) == WAIT_TIMEOUT;
+    CloseHandle( process );
+    return alive;
+#else
+    return true;
+#endif
+}
+
+QList<SingleApplication::InstanceInfo> SingleApplicationPrivate::instances()
+{
+    QList<SingleApplication::InstanceInfo> list;
+    const InstancesInfo* inst = static_cast<const InstancesInfo*>( memory->constData() );
+
+    for( const InstanceSlot &slot : inst->instances ) {
+        SingleApplication::InstanceInfo info;
+        quint32 state;
+        quint32 sequence;
+        do {
+            sequence = beginRead( slot.sequence );
+            state = slot.state.load( std::memory_order_relaxed );
+            info.id = slot.id.load( std::memory_order_relaxed );
+            info.pid = slot.pid.load( std::memory_order_relaxed );
+            info.startTime = slot.startTime.load( std::memory_order_relaxed );
+        } while( ! endRead( slot.sequence, sequence ) );
+
+        if( ( state != InstanceSlot::Primary && state != InstanceSlot::Secondary ) || info.pid <= 0 )
+            continue;
+
+        info.primary = state == InstanceSlot::Primary;
+        list.append( info );
+    }
+
+    return list;
+}
+
+/**
+ * @brief Executed when a connection has been made to the LocalServer
+ */
+void SingleApplicationPrivate::slotConnectionEstablished()
+{
+    // Spooled messages precede anything sent over a connection
+    replaySpool();
+
+    // Instances built against 3.x connect to the legacy server
+    QLocalServer *pendingServer = server;
+    if( legacyServer != nullptr && ! server->hasPendingConnections() )
+        pendingServer = legacyServer;
+
+    QLocalSocket *nextConnSocket = pendingServer->nextPendingConnection();
+    if( nextConnSocket == nullptr )
+        return;
+    ConnectionInfo &connection = connectionMap.insert(nextConnSocket, ConnectionInfo()).value();
+    readPeerCredentials( nextConnSocket, connection );
+    publishHeartbeat();
+    countMetric( metrics().connectionsAccepted );
+    recordEvent( SingleApplication::IpcEvent::ConnectionAccepted, 0, static_cast<quint64>( connection.peerPid ) );
+
+    if( ipcEpollFd != -1 )
+        watchIpcDescriptor( nextConnSocket->socketDescriptor() );
+
+    QObject::connect(nextConnSocket, &QLocalSocket::aboutToClose,
+        nextConnSocket, [nextConnSocket, this]() {
+            if (!connectionMap.contains( nextConnSocket ))
+                return;
+            const auto &info = connectionMap[nextConnSocket];
+            Q_EMIT this->slotClientConnectionClosed( nextConnSocket, info.instanceId, info.peerPid );
+        }
+    );
+
+    QObject::connect(nextConnSocket, &QLocalSocket::disconnected,
+        nextConnSocket, [nextConnSocket, this](){
+            if (!connectionMap.contains( nextConnSocket ))
+                return;
+            connectionMap.remove(nextConnSocket);
+            nextConnSocket->deleteLater();
+
+            // Secondary instances release their slot before disconnecting
+            slotSweepInstances();
+        }
+    );
+
+    QObject::connect(nextConnSocket, &QLocalSocket::readyRead,
+        nextConnSocket, [nextConnSocket, this]() {
+            const auto it = connectionMap.constFind( nextConnSocket );
+            if (it == connectionMap.constEnd())
+                return;
+            publishHeartbeat();
+            const ConnectionInfo &info = it.value();
+            switch(info.stage) {
+            case StageHeader:
+                readInitMessageHeader(nextConnSocket);
+                break;
+            case StageBody:
+                readInitMessageBody(nextConnSocket);
+                break;
+            case StageConnected:
+                Q_EMIT this->slotDataAvailable( nextConnSocket, info.instanceId, info.peerPid );
+                break;
+            default:
+                break;
+            };
+        }
+    );
+
+#ifdef Q_OS_UNIX
+    // The socket permissions of the User mode already keep other users out,
+    // the kernel credentials make sure of it
+    const ConnectionInfo &info = connectionMap.constFind( nextConnSocket ).value();
+    if( options & SingleApplication::Mode::User && info.peerUid != -1 && info.peerUid != static_cast<qint64>( geteuid() ) )
+        rejectHandshake( nextConnSocket, SingleApplication::IpcEvent::WrongUser );
+#endif
+}
 
-    if (!connectionMap.contains( sock )) {
+/**
+ * @brief Asks the kernel which process is on the other end of a connection,
+ * which unlike anything in the handshake can't be forged by the peer
+ */
+void SingleApplicationPrivate::readPeerCredentials( QLocalSocket *sock, ConnectionInfo &info )
+{
+    const qintptr descriptor = sock->socketDescriptor();
+#if defined( Q_OS_LINUX )
+    struct ucred credentials;
+    socklen_t length = sizeof( credentials );
+    if( getsockopt( static_cast<int>( descriptor ), SOL_SOCKET, SO_PEERCRED, &credentials, &length ) == 0 ) {
+        info.peerPid = credentials.pid;
+        info.peerUid = credentials.uid;
+    }
+#elif defined( Q_OS_UNIX )
+    uid_t uid;
+    gid_t gid;
+    if( getpeereid( static_cast<int>( descriptor ), &uid, &gid ) == 0 )
+        info.peerUid = uid;
+#ifdef LOCAL_PEERPID
+    pid_t pid;
+    socklen_t length = sizeof( pid );
+    if( getsockopt( static_cast<int>( descriptor ), SOL_LOCAL, LOCAL_PEERPID, &pid, &length ) == 0 )
+        info.peerPid = pid;
+#endif
+#elif defined( Q_OS_WIN )
+    ULONG pid;
+    if( GetNamedPipeClientProcessId( reinterpret_cast<HANDLE>( descriptor ), &pid ) )
+        info.peerPid = pid;
+#else
+    Q_UNUSED( descriptor );
+    Q_UNUSED( info );
+#endif
+}
+
+void SingleApplicationPrivate::readInitMessageHeader( QLocalSocket *sock )
+{
+    const auto it = connectionMap.find( sock );
+    if (it == connectionMap.end()) {
+        return;
+    }
+
+    // The shortest QDataStream handshake of 3.x is longer than this
+    if( sock->bytesAvailable() < ( qint64 )( sizeof( quint64 ) + sizeof( quint32 ) ) ) {
         return;
     }
 
-    ConnectionInfo &info = connectionMap[sock];
-    if( sock->bytesAvailable() < ( qint64 )info.msgLen ) {
+    // Only peek at the length and the magic number, the whole message is
+    // read in one go
+    uchar header[sizeof( quint64 ) + sizeof( quint32 )];
+    sock->peek( reinterpret_cast<char*>( header ), sizeof( header ) );
+
+    // Anything without the magic number is the QDataStream handshake of 3.x,
+    // where the length is followed by the length of the block name. Don't
+    // wait for a message that would be rejected anyway.
+    const quint64 length = qFromBigEndian<quint64>( header );
+    ConnectionInfo &info = it.value();
+    if( qFromBigEndian<quint32>( header + sizeof( quint64 ) ) == InitMessage::Magic ) {
+        if( length != sizeof( InitMessage ) - sizeof( quint64 ) ) {
+            rejectHandshake( sock, SingleApplication::IpcEvent::Malformed );
+            return;
+        }
+        info.legacy = false;
+        info.msgLen = sizeof( InitMessage );
+    } else if( length <= MaxLegacyInitMessageLength ) {
+        info.legacy = true;
+        info.msgLen = static_cast<qint64>( sizeof( quint64 ) + length );
+    } else {
+        rejectHandshake( sock, SingleApplication::IpcEvent::TooLarge );
         return;
     }
 
-    // Read the message body
-    QByteArray msgBytes = sock->read(info.msgLen);
-    QDataStream readStream(msgBytes);
+    info.stage = StageBody;
+    SINGLEAPPLICATION_KILL_POINT( "receiveHandshake" );
+
+    readInitMessageBody( sock );
+}
+
+void SingleApplicationPrivate::rejectHandshake( QLocalSocket *sock, SingleApplication::IpcEvent::RejectReason reason )
+{
+    countMetric( metrics().handshakesRejected );
+    recordEvent( SingleApplication::IpcEvent::HandshakeRejected, reason );
+    sock->close();
+}
+
+/**
+ * @brief Validates an initialisation message and decodes its fields
+ * @returns {bool} Whether the message is valid and meant for this block
+ */
+bool SingleApplicationPrivate::parseInitMessage( const char *data, qint64 size, InitInfo &init, SingleApplication::IpcEvent::RejectReason &reason )
+{
+    reason = SingleApplication::IpcEvent::Malformed;
+    if( size != static_cast<qint64>( sizeof( InitMessage ) ) )
+        return false;
+
+    InitMessage message;
+    memcpy( &message, data, sizeof( message ) );
+
+    if( qFromBigEndian( message.length ) != sizeof( InitMessage ) - sizeof( quint64 ) ||
+        qFromBigEndian( message.magic ) != InitMessage::Magic ||
+        qFromBigEndian( message.version ) == 0 )
+        return false;
+
+    if( qFromBigEndian( message.checksum ) != crc32c( data, offsetof( InitMessage, checksum ) ) ) {
+        reason = SingleApplication::IpcEvent::BadChecksum;
+        return false;
+    }
+
+    if( qFromBigEndian( message.keyHash ) != blockKeyHash ) {
+        reason = SingleApplication::IpcEvent::WrongKey;
+        return false;
+    }
 
-#if (QT_VERSION >= QT_VERSION_CHECK(5, 6, 0))
+    if( qFromBigEndian( message.extensionLength ) > MaxInitExtensionLength ) {
+        reason = SingleApplication::IpcEvent::TooLarge;
+        return false;
+    }
+
+    // Settle on what both ends support
+    init.connectionType = static_cast<ConnectionType>( message.type );
+    init.version = qMin<quint16>( qFromBigEndian( message.version ), InitMessage::Version );
+    init.capabilities = qFromBigEndian( message.capabilities ) & InitMessage::Capabilities;
+    init.instanceId = qFromBigEndian( message.instanceId );
+    init.extensionLength = qFromBigEndian( message.extensionLength );
+    init.launchTime = qFromBigEndian( message.launchTime );
+    return true;
+}
+
+/**
+ * @brief Validates a QDataStream handshake of SingleApplication 3.x, header
+ * included, and decodes its fields
+ * @returns {bool} Whether the message is valid and meant for this block
+ */
+bool SingleApplicationPrivate::parseLegacyInitMessage( const QByteArray &message, InitInfo &init, SingleApplication::IpcEvent::RejectReason &reason )
+{
+    reason = SingleApplication::IpcEvent::Malformed;
+    if( message.size() < static_cast<int>( sizeof( quint64 ) + sizeof( quint16 ) ) )
+        return false;
+
+    QDataStream readStream( message );
     readStream.setVersion( QDataStream::Qt_5_6 );
-#endif
 
-    // server name
+    quint64 length;
+    readStream >> length;
+
+    // Read the key
     QByteArray latin1Name;
     readStream >> latin1Name;
 
-    // connection type
-    ConnectionType connectionType = InvalidConnection;
+    // Read the type
     quint8 connTypeVal = InvalidConnection;
     readStream >> connTypeVal;
-    connectionType = static_cast <ConnectionType>( connTypeVal );
 
-    // instance id
+    // Read the instance id
     quint32 instanceId = 0;
     readStream >> instanceId;
 
-    // checksum
+    // Read the checksum of the fields before it
     quint16 msgChecksum = 0;
     readStream >> msgChecksum;
 
-    const quint16 actualChecksum = qChecksum( msgBytes.constData(), static_cast<quint32>( msgBytes.length() - sizeof( quint16 ) ) );
+    if( readStream.status() != QDataStream::Ok || ! readStream.atEnd() )
+        return false;
+
+    const char *body = message.constData() + sizeof( quint64 );
+    const uint bodyLength = static_cast<uint>( message.size() - sizeof( quint64 ) - sizeof( quint16 ) );
+    if( msgChecksum != qChecksum( body, bodyLength ) ) {
+        reason = SingleApplication::IpcEvent::BadChecksum;
+        return false;
+    }
+
+    // Without a name of the 3.x block nobody can send a valid one
+    if( legacyServerName.isEmpty() || latin1Name != legacyServerName.toLatin1() ) {
+        reason = SingleApplication::IpcEvent::WrongKey;
+        return false;
+    }
+
+    init.connectionType = static_cast<ConnectionType>( connTypeVal );
+    init.version = 0;
+    init.capabilities = InitMessage::NoCapabilities;
+    init.instanceId = instanceId;
+    init.extensionLength = 0;
+    init.launchTime = 0;
+    return true;
+}
 
-    bool isValid = readStream.status() == QDataStream::Ok &&
-                   QLatin1String(latin1Name) == blockServerName &&
-                   msgChecksum == actualChecksum;
+void SingleApplicationPrivate::readInitMessageBody( QLocalSocket *sock )
+{
+    Q_Q(SingleApplication);
+
+    const auto it = connectionMap.find( sock );
+    if (it == connectionMap.end()) {
+        return;
+    }
+
+    ConnectionInfo &info = it.value();
+    if( sock->bytesAvailable() < info.msgLen ) {
+        return;
+    }
+
+    InitInfo init;
+    SingleApplication::LaunchInfo launch = SingleApplication::LaunchInfo();
+    SingleApplication::IpcEvent::RejectReason reason;
+    bool isValid;
+    if( info.legacy ) {
+        isValid = parseLegacyInitMessage( sock->read( info.msgLen ), init, reason );
+    } else {
+        char message[sizeof( InitMessage )];
+        sock->peek( message, sizeof( message ) );
+        isValid = parseInitMessage( message, sizeof( message ), init, reason );
+
+        // Wait for the extension before taking anything off the socket
+        if( isValid && init.extensionLength > 0 ) {
+            info.msgLen = static_cast<qint64>( sizeof( InitMessage ) ) + init.extensionLength;
+            if( sock->bytesAvailable() < info.msgLen )
+                return;
+        }
+
+        sock->read( message, sizeof( message ) );
+        if( isValid && init.extensionLength > 0 &&
+            ! parseLaunchDetails( sock->read( init.extensionLength ), launch ) ) {
+            isValid = false;
+            reason = SingleApplication::IpcEvent::Malformed;
+        }
+    }
 
     if( !isValid ) {
-        sock->close();
+        rejectHandshake( sock, reason );
         return;
     }
 
+    // Tell the secondary what the connection settled on
+    if( ! info.legacy ) {
+        InitReply reply;
+        reply.magic = qToBigEndian<quint32>( InitMessage::Magic );
+        reply.version = qToBigEndian<quint16>( init.version );
+        reply.flags = 0;
+        reply.capabilities = qToBigEndian<quint32>( init.capabilities );
+        sock->write( reinterpret_cast<const char*>( &reply ), sizeof( reply ) );
+    }
+
+    countMetric( metrics().handshakesAccepted );
+    recordEvent( SingleApplication::IpcEvent::HandshakeAccepted, init.connectionType, init.instanceId );
+
+    const ConnectionType connectionType = init.connectionType;
+    const quint32 instanceId = init.instanceId;
+    const qint64 peerPid = info.peerPid;
+    launch.launchTime = init.launchTime;
+
     info.instanceId = instanceId;
+    info.version = init.version;
+    info.capabilities = init.capabilities;
     info.stage = StageConnected;
+    info.launch = launch;
 
     if( connectionType == NewInstance ||
         ( connectionType == SecondaryInstance &&
           options & SingleApplication::Mode::SecondaryNotification ) )
     {
-        Q_EMIT q->instanceStarted();
+        // Within a batching window the activations collapse into a single
+        // instanceStarted() when the window closes
+        if( batchTimer == nullptr ) {
+            Q_EMIT q->instanceStarted();
+        } else {
+            batchStarted = true;
+            startBatch();
+        }
+        Q_EMIT q->instanceLaunched( instanceId, launch );
     }
 
     if (sock->bytesAvailable() > 0) {
-        Q_EMIT this->slotDataAvailable( sock, instanceId );
+        Q_EMIT this->slotDataAvailable( sock, instanceId, peerPid );
+    }
+}
+
+/**
+ * @brief Lazily creates an epoll descriptor watching the server and every
+ * client socket. An epoll descriptor is itself readable whenever any of the
+ * descriptors it watches is, which lets foreign event loops wait on it.
+ */
+int SingleApplicationPrivate::ipcEventFd()
+{
+#if defined(Q_OS_LINUX) && QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
+    if( server == nullptr )
+        return -1;
+
+    if( ipcEpollFd == -1 ) {
+        ipcEpollFd = epoll_create1( EPOLL_CLOEXEC );
+        if( ipcEpollFd == -1 )
+            return -1;
+
+        watchIpcDescriptor( server->socketDescriptor() );
+        if( legacyServer != nullptr )
+            watchIpcDescriptor( legacyServer->socketDescriptor() );
+        for( QLocalSocket *sock : connectionMap.keys() )
+            watchIpcDescriptor( sock->socketDescriptor() );
+    }
+
+    return ipcEpollFd;
+#else
+    return -1;
+#endif
+}
+
+void SingleApplicationPrivate::watchIpcDescriptor( qintptr descriptor )
+{
+#ifdef Q_OS_LINUX
+    if( descriptor == -1 )
+        return;
+
+    // Closed descriptors are removed from the epoll set by the kernel, so
+    // there is no need to unregister sockets when they disconnect.
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = static_cast<int>( descriptor );
+    epoll_ctl( ipcEpollFd, EPOLL_CTL_ADD, static_cast<int>( descriptor ), &event );
+#else
+    Q_UNUSED( descriptor );
+#endif
+}
+
+/**
+ * @brief Drives the server and all client sockets directly, emitting the same
+ * signals the Qt event loop would
+ */
+void SingleApplicationPrivate::processIpcEvents()
+{
+    if( server == nullptr )
+        return;
+
+    // Without an event loop nothing else publishes the heartbeat
+    publishHeartbeat();
+
+    // Without an event loop the spool is replayed on the first call
+    replaySpool();
+
+    // Each call accepts at most one connection and reports it through
+    // slotConnectionEstablished(), so keep going until nothing new arrives
+    int knownConnections;
+    do {
+        knownConnections = connectionMap.size();
+        server->waitForNewConnection( 0 );
+        if( legacyServer != nullptr )
+            legacyServer->waitForNewConnection( 0 );
+    } while( connectionMap.size() > knownConnections );
+
+    // Reading with a zero timeout pulls whatever the kernel has buffered and
+    // emits readyRead() or disconnected() synchronously
+    // Sockets may disconnect while reading, so iterate over a snapshot. It
+    // lives on the stack unless there are many connections.
+    QVarLengthArray<QLocalSocket*, 16> sockets;
+    for( auto it = connectionMap.constBegin(); it != connectionMap.constEnd(); ++it )
+        sockets.append( it.key() );
+
+    for( QLocalSocket *sock : sockets ) {
+        if( connectionMap.contains( sock ) )
+            sock->waitForReadyRead( 0 );
+    }
+
+    // Nor is there one to fire the batch timer, close the window once it
+    // is over
+    if( batchTimer != nullptr && batchTimer->isActive() && batchTimer->remainingTime() == 0 )
+        slotFlushBatch();
+}
+
+#ifdef SINGLEAPPLICATION_FAULT_INJECTION
+/**
+ * @brief Whether SINGLEAPPLICATION_KILL_AT selects the given kill point
+ */
+bool SingleApplicationPrivate::isKillPoint( const char *name )
+{
+    static const QByteArray killAt = qgetenv( "SINGLEAPPLICATION_KILL_AT" );
+    return killAt == name;
+}
+
+/**
+ * @brief Dies on the spot when the kill point is selected, without running
+ * any destructor, the way a crash or SIGKILL would
+ */
+void SingleApplicationPrivate::killPoint( const char *name )
+{
+    if( ! isKillPoint( name ) )
+        return;
+
+#if defined(Q_OS_UNIX)
+    ::kill( ::getpid(), SIGKILL );
+#elif defined(Q_OS_WIN)
+    TerminateProcess( GetCurrentProcess(), EXIT_FAILURE );
+#endif
+    std::_Exit( EXIT_FAILURE );
+}
+#endif
+
+void SingleApplicationPrivate::slotDataAvailable( QLocalSocket *dataSocket, quint32 instanceId, qint64 peerPid )
+{
+    replaySpool();
+
+    const auto it = connectionMap.constFind( dataSocket );
+    if( it != connectionMap.constEnd() && it.value().capabilities & InitMessage::Acknowledgements ) {
+        readMessageFrames( dataSocket, instanceId, it.value().launch.launchTime, peerPid );
+        return;
+    }
+
+    deliverMessage( instanceId, peerPid, dataSocket->readAll() );
+}
+
+/**
+ * @brief Hands a message to the application, through the inbox if it has one
+ */
+void SingleApplicationPrivate::deliverMessage( quint32 instanceId, qint64 peerPid, const QByteArray &message )
+{
+    Q_Q(SingleApplication);
+
+    countMetric( metrics().messagesReceived );
+    countMetric( metrics().bytesReceived, static_cast<quint64>( message.size() ) );
+    recordEvent( SingleApplication::IpcEvent::MessageReceived, instanceId, static_cast<quint64>( message.size() ) );
+
+    if( inboxCapacity == 0 && batchTimer != nullptr ) {
+        // Identical payloads within a window are delivered once
+        if( batchPayloads.contains( message ) ) {
+            countMetric( metrics().duplicatesDropped );
+            return;
+        }
+        batchPayloads.insert( message );
+
+        SingleApplication::Message entry;
+        entry.instanceId = instanceId;
+        entry.peerPid = peerPid;
+        entry.received = monotonicMSecs();
+        entry.message = message;
+        batch.append( entry );
+        startBatch();
+        return;
+    }
+
+    if( inboxCapacity == 0 ) {
+        Q_EMIT q->receivedMessage( instanceId, message );
+        Q_EMIT q->receivedMessageFrom( instanceId, peerPid, message );
+        return;
     }
+
+    // A full inbox makes room by dropping the oldest message
+    expireMessages();
+    if( inbox.size() >= inboxCapacity ) {
+        inbox.dequeue();
+        countMetric( metrics().messagesDiscarded );
+    }
+
+    SingleApplication::Message entry;
+    entry.instanceId = instanceId;
+    entry.peerPid = peerPid;
+    entry.received = monotonicMSecs();
+    entry.message = message;
+    inbox.enqueue( entry );
+
+    if( inbox.size() == 1 )
+        Q_EMIT q->messagesAvailable();
 }
 
-void SingleApplicationPrivate::slotDataAvailable( QLocalSocket *dataSocket, quint32 instanceId )
+/**
+ * @brief Opens a batching window unless one is already open
+ */
+void SingleApplicationPrivate::startBatch()
+{
+    if( ! batchTimer->isActive() )
+        batchTimer->start();
+}
+
+/**
+ * @brief Closes the batching window and delivers what arrived within it
+ */
+void SingleApplicationPrivate::slotFlushBatch()
 {
     Q_Q(SingleApplication);
-    Q_EMIT q->receivedMessage( instanceId, dataSocket->readAll() );
+
+    // Handlers may receive more messages, which open the next window
+    batchTimer->stop();
+    const bool started = batchStarted;
+    QVector<SingleApplication::Message> messages;
+    messages.swap( batch );
+    batchStarted = false;
+    batchPayloads.clear();
+
+    if( started )
+        Q_EMIT q->instanceStarted();
+    if( ! messages.isEmpty() )
+        Q_EMIT q->receivedMessages( messages );
+}
+
+/**
+ * @brief Drops the messages which have been in the inbox for longer than
+ * their time to live. The inbox is in the order of arrival.
+ */
+void SingleApplicationPrivate::expireMessages()
+{
+    if( messageTimeToLive <= 0 )
+        return;
+
+    const qint64 oldest = monotonicMSecs() - messageTimeToLive;
+    while( ! inbox.isEmpty() && inbox.head().received < oldest ) {
+        inbox.dequeue();
+        countMetric( metrics().messagesDiscarded );
+    }
+}
+
+/**
+ * @brief Takes up to max messages out of the inbox, oldest first
+ */
+QVector<SingleApplication::Message> SingleApplicationPrivate::takeMessages( int max )
+{
+    expireMessages();
+
+    const int count = max < 0 ? inbox.size() : qMin( max, inbox.size() );
+    QVector<SingleApplication::Message> messages;
+    messages.reserve( count );
+    for( int i = 0; i < count; ++i )
+        messages.append( inbox.dequeue() );
+    return messages;
+}
+
+/**
+ * @brief Handles the complete frames of a connection with acknowledgements
+ * and acknowledges the last one once its handlers have returned. Frames that
+ * were handled before, on an earlier connection, are only acknowledged.
+ */
+void SingleApplicationPrivate::readMessageFrames( QLocalSocket *dataSocket, quint32 instanceId, qint64 launchTime, qint64 peerPid )
+{
+    bool handled = false;
+    quint32 lastSequence = 0;
+    while( dataSocket->bytesAvailable() >= static_cast<qint64>( sizeof( MessageFrame ) ) ) {
+        MessageFrame frame;
+        dataSocket->peek( reinterpret_cast<char*>( &frame ), sizeof( frame ) );
+        const quint32 length = qFromBigEndian( frame.length );
+        if( length > MaxMessageFrameLength ) {
+            qWarning() << "SingleApplication: Dropping a connection which sent a message of" << length << "bytes.";
+            dataSocket->close();
+            return;
+        }
+        if( dataSocket->bytesAvailable() < static_cast<qint64>( sizeof( MessageFrame ) + length ) )
+            break;
+
+        dataSocket->read( reinterpret_cast<char*>( &frame ), sizeof( frame ) );
+        const QByteArray message = dataSocket->read( length );
+
+        // A corrupted frame can't be trusted to delimit the next one
+        if( crc32c( message.constData(), static_cast<size_t>( message.size() ) ) != qFromBigEndian( frame.checksum ) ) {
+            qWarning() << "SingleApplication: Dropping a connection which sent a corrupted message.";
+            dataSocket->close();
+            return;
+        }
+
+        lastSequence = qFromBigEndian( frame.sequence );
+        handled = true;
+
+        // Handlers may process other connections and change the map, so it is
+        // looked up again for every frame
+        DeliveryState &delivery = deliveries[instanceId];
+        if( delivery.launchTime != launchTime ) {
+            delivery.launchTime = launchTime;
+            delivery.sequence = 0;
+        }
+
+        // The secondary sends whatever wasn't acknowledged again on a new
+        // connection, so frames may arrive twice
+        if( lastSequence <= delivery.sequence ) {
+            countMetric( metrics().duplicatesDropped );
+            continue;
+        }
+        delivery.sequence = lastSequence;
+
+        deliverMessage( instanceId, peerPid, message );
+    }
+
+    // One acknowledgement covers everything handled in this wakeup
+    if( handled && dataSocket->state() == QLocalSocket::ConnectedState ) {
+        uchar acknowledgement[sizeof( quint32 )];
+        qToBigEndian<quint32>( lastSequence, acknowledgement );
+        dataSocket->write( reinterpret_cast<const char*>( acknowledgement ), sizeof( acknowledgement ) );
+    }
+}
+
+/**
+ * @brief Reports the instances that have left the registry since the last
+ * sweep through instanceStopped()
+ */
+void SingleApplicationPrivate::slotSweepInstances()
+{
+    Q_Q(SingleApplication);
+
+    QSet<quint64> running;
+    for( const SingleApplication::InstanceInfo &info : instances() ) {
+        if( ! info.primary )
+            running.insert( info.id );
+    }
+
+    const QSet<quint64> stopped = knownInstances - running;
+    knownInstances = running;
+
+    for( quint64 id : stopped ) {
+        // A stopped instance won't send anything again
+        deliveries.remove( static_cast<quint32>( id ) );
+        Q_EMIT q->instanceStopped( id );
+    }
+}
+
+void SingleApplicationPrivate::slotReapInstances()
+{
+    reapDeadInstances();
+    slotSweepInstances();
 }
 
-void SingleApplicationPrivate::slotClientConnectionClosed( QLocalSocket *closedSocket, quint32 instanceId )
+void SingleApplicationPrivate::slotClientConnectionClosed( QLocalSocket *closedSocket, quint32 instanceId, qint64 peerPid )
 {
     if( closedSocket->bytesAvailable() > 0 )
-        Q_EMIT slotDataAvailable( closedSocket, instanceId  );
+        Q_EMIT slotDataAvailable( closedSocket, instanceId, peerPid );
 }
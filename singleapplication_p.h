@@ -32,12 +32,153 @@
 #ifndef SINGLEAPPLICATION_P_H
 #define SINGLEAPPLICATION_P_H
 
+#include <atomic>
+
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QHash>
+#include <QtCore/QMap>
+#include <QtCore/QQueue>
+#include <QtCore/QSet>
+#include <QtCore/QTimer>
 #include <QtCore/QSharedMemory>
 #include <QtNetwork/QLocalServer>
 #include <QtNetwork/QLocalSocket>
 #include "singleapplication.h"
 
+// Kill points let the recovery benchmark die at precise moments of the
+// election. They compile to nothing unless SINGLEAPPLICATION_FAULT_INJECTION is
+// defined, in which case SINGLEAPPLICATION_KILL_AT selects one at runtime.
+#ifdef SINGLEAPPLICATION_FAULT_INJECTION
+    #define SINGLEAPPLICATION_KILL_POINT( name ) SingleApplicationPrivate::killPoint( name )
+#else
+    #define SINGLEAPPLICATION_KILL_POINT( name ) do {} while( false )
+#endif
+
+/**
+ * @brief An entry of the instance registry. A slot is owned by the instance
+ * that claimed it (or by the primary reaping it after a crash) and guarded by
+ * its own seqlock so that any process can enumerate the registry.
+ *
+ * Instances only register while holding the memory lock, so a slot still
+ * Registering when the lock is taken belongs to an instance that died half way
+ * through and is taken over.
+ */
+struct InstanceSlot {
+    enum State : quint32 {
+        Free = 0,
+        Claimed = 1,        // By a reaper
+        Primary = 2,
+        Secondary = 3,
+        Registering = 4
+    };
+    std::atomic<quint32> sequence;
+    std::atomic<quint32> state;
+    std::atomic<qint64> pid;
+    std::atomic<quint64> id;
+    std::atomic<qint64> startTime;
+};
+
+/**
+ * @brief A counter padded to a cache line, so that processes updating
+ * different counters don't contend for the same line
+ */
+struct alignas(64) MetricsCounter {
+    std::atomic<quint64> value;
+};
+
+/**
+ * @brief Live IPC metrics, updated by every instance and read without locking
+ * by the singleapp-stat tool. Bucket n of the lock wait histogram counts the
+ * waits which took less than 2^n microseconds and didn't fit a smaller bucket,
+ * the last bucket counts everything longer.
+ */
+struct IpcMetrics {
+    enum { LockWaitBuckets = 20 };
+    MetricsCounter connectionsAccepted;
+    MetricsCounter handshakesAccepted;
+    MetricsCounter handshakesRejected;
+    MetricsCounter messagesReceived;
+    MetricsCounter duplicatesDropped;
+    MetricsCounter messagesDiscarded;
+    MetricsCounter bytesReceived;
+    MetricsCounter primaryStarts;
+    MetricsCounter secondaryStarts;
+    MetricsCounter connectionsMade;
+    MetricsCounter connectionsFailed;
+    struct alignas(64) {
+        std::atomic<quint64> buckets[LockWaitBuckets];
+    } lockWait;
+};
+
+/**
+ * @brief An entry of the flight recorder. Its sequence is odd while the entry
+ * is being written and 2 * index + 2 once the event with that index is
+ * complete, so readers can tell torn and overwritten entries apart.
+ */
+struct FlightEvent {
+    std::atomic<quint64> sequence;
+    std::atomic<qint64> time;
+    std::atomic<qint64> pid;
+    std::atomic<quint64> value;
+    std::atomic<quint32> detail;
+    std::atomic<quint16> type;
+};
+
+/**
+ * @brief A ring of the most recent IPC events, written lock-free by every
+ * instance. A writer claims the next index and overwrites the entry at
+ * index % Capacity.
+ */
+struct FlightRecorder {
+    enum { Capacity = 256 };
+    alignas(64) std::atomic<quint64> head;
+    FlightEvent events[Capacity];
+};
+
+// Leads a crash dump of the flight recorder, which is followed by the raw
+// FlightRecorder of the crashed process
+static const quint64 FlightRecorderDumpMagic = Q_UINT64_C( 0x544847494c464153 ); // "SAFLIGHT"
+
+/**
+ * @brief Layout of the shared memory block. It is guarded by a seqlock:
+ * writers hold the QSharedMemory lock and make the sequence odd while they
+ * update the block, readers never lock and retry if the sequence moved.
+ * The instance slots are not covered by the block sequence.
+ *
+ * The layout version is part of the block name, so that builds with different
+ * layouts never attach to each other's block. Bump it on every change. The
+ * primary instance also claims the LegacyInstancesInfo block, which is how it
+ * is found by instances built against SingleApplication 3.x.
+ */
 struct InstancesInfo {
+    enum {
+        LayoutVersion = 2,          // SingleApplication 3.x is 1
+        MaxInstances = 64,
+        HeartbeatInterval = 1000,
+        HeartbeatTimeout = 5000
+    };
+    std::atomic<quint32> sequence;
+    std::atomic<bool> primary;
+    std::atomic<quint32> secondary;
+    std::atomic<quint32> generation;
+    std::atomic<qint64> primaryPid;
+    std::atomic<qint64> primaryHeartbeat;
+    std::atomic<quint16> primaryVersion;        // Protocol the primary speaks, 0 if none
+    std::atomic<quint32> primaryCapabilities;
+    std::atomic<qint64> primaryUid;             // Effective uid on Unix, -1 elsewhere
+    char primaryUser[128];                      // Empty on Unix, see primaryUid
+    InstanceSlot instances[MaxInstances];
+    IpcMetrics metrics;
+    FlightRecorder recorder;
+};
+
+/**
+ * @brief Layout of the shared memory block of SingleApplication 3.x, named
+ * without the layout version and after the user name in User mode. It is
+ * guarded by its own QSharedMemory lock and a qChecksum() of the fields before
+ * the checksum.
+ */
+struct LegacyInstancesInfo {
     bool primary;
     quint32 secondary;
     qint64 primaryPid;
@@ -45,12 +186,124 @@ struct InstancesInfo {
     char primaryUser[128];
 };
 
+inline void countMetric( MetricsCounter &counter, quint64 amount = 1 )
+{
+    counter.value.fetch_add( amount, std::memory_order_relaxed );
+}
+
+/**
+ * @brief The handshake a connecting instance sends, every field in network
+ * byte order. It starts with the length of what follows, like the QDataStream
+ * handshake of SingleApplication 3.x, and the magic number tells them apart.
+ * The checksum is the CRC32C of the fields before it and the key hash
+ * identifies the block without sending its name.
+ *
+ * The version is the highest protocol both ends speak and the capabilities
+ * are the optional features the sender would like to use. The primary answers
+ * with an InitReply holding what the connection settled on.
+ */
+struct InitMessage {
+    enum : quint32 { Magic = 0x53415050 };  // "SAPP"
+    enum : quint16 { Version = 1 };
+    enum Capability : quint32 {
+        NoCapabilities = 0,
+        LaunchDetails = 1 << 0,    // The extension may carry a LaunchDetailsRecord list
+        Acknowledgements = 1 << 1  // Messages are sent as MessageFrame and acknowledged
+    };
+    enum : quint32 { Capabilities = LaunchDetails | Acknowledgements };  // Supported by this version
+    quint64 length;
+    quint32 magic;
+    quint16 version;
+    quint8 type;
+    quint8 flags;
+    quint32 capabilities;
+    quint32 instanceId;
+    quint64 keyHash;
+    qint64 launchTime;
+    quint32 extensionLength;    // Bytes following the message
+    quint32 checksum;
+};
+static_assert( sizeof( InitMessage ) == 48, "InitMessage must not contain padding" );
+
+// Largest handshake extension which is accepted
+static const quint32 MaxInitExtensionLength = 1 << 20;
+
+/**
+ * @brief Tags of the launch details in the handshake extension. Each record
+ * is the tag, the length of the value as a big endian quint32 and the UTF-8
+ * value. Unknown tags are skipped.
+ */
+enum LaunchDetailsRecord : quint8 {
+    ArgumentRecord = 1,
+    WorkingDirectoryRecord = 2,
+    EnvironmentRecord = 3          // NAME=value
+};
+
+/**
+ * @brief The answer of the primary to an InitMessage, in network byte order.
+ * Handshakes in the legacy QDataStream format get no reply.
+ */
+struct InitReply {
+    quint32 magic;
+    quint16 version;
+    quint16 flags;
+    quint32 capabilities;
+};
+static_assert( sizeof( InitReply ) == 12, "InitReply must not contain padding" );
+
+/**
+ * @brief Header of a message on a connection with acknowledgements, in network
+ * byte order, followed by the message itself. The primary answers with the
+ * sequence of the last frame it has handled as a big endian quint32, once the
+ * receivedMessage() handlers have returned.
+ */
+struct MessageFrame {
+    quint32 sequence;   // Counts up from 1 for every message of an instance
+    quint32 length;
+    quint32 checksum;   // CRC32C of the message
+};
+static_assert( sizeof( MessageFrame ) == 12, "MessageFrame must not contain padding" );
+
+// Largest acknowledged message which is accepted
+static const quint32 MaxMessageFrameLength = 1 << 30;
+
+/**
+ * @brief The last frame the primary handled from an instance. A secondary
+ * which lost its connection sends the frames that were not acknowledged again.
+ */
+struct DeliveryState {
+    qint64 launchTime;  // Tells instances reusing an id apart
+    quint32 sequence;
+};
+
+/**
+ * @brief A message in the spool journal, in network byte order and followed
+ * by the message. A record torn by a crash fails its checksum and ends the
+ * journal.
+ */
+struct SpoolRecord {
+    quint32 length;
+    quint32 instanceId;
+    quint32 checksum;   // CRC32C of the message
+};
+static_assert( sizeof( SpoolRecord ) == 12, "SpoolRecord must not contain padding" );
+
+// Longest handshake in the QDataStream format of SingleApplication 3.x which
+// is still accepted
+static const quint64 MaxLegacyInitMessageLength = 256;
+
 struct ConnectionInfo {
     explicit ConnectionInfo() :
-        msgLen(0), instanceId(0), stage(0) {}
-    qint64 msgLen;
+        msgLen(0), peerPid(-1), peerUid(-1), instanceId(0), capabilities(0), version(0), stage(0), legacy(false), launch() {}
+    qint64 msgLen;  // Of the whole initialisation message
+    qint64 peerPid; // As reported by the kernel, -1 if unknown
+    qint64 peerUid;
     quint32 instanceId;
+    quint32 capabilities;
+    quint16 version;    // 0 for the legacy format
     quint8 stage;
+    bool legacy;
+    SingleApplication::LaunchInfo launch;
 };
 
 class SingleApplicationPrivate : public QObject {
@@ -67,36 +320,142 @@ public:
         StageBody = 1,
         StageConnected = 2,
     };
+    // A decoded initialisation message
+    struct InitInfo {
+        ConnectionType connectionType;
+        quint16 version;
+        quint32 capabilities;
+        quint32 instanceId;
+        quint32 extensionLength;
+        qint64 launchTime;
+    };
     Q_DECLARE_PUBLIC(SingleApplication)
 
     SingleApplicationPrivate( SingleApplication *q_ptr );
      ~SingleApplicationPrivate() override;
 
     QString getUsername();
+    static QString usernameForUid( qint64 uid );
+    static QByteArray userScope();
     void genBlockServerName( const QByteArray &extraHashData );
+    void genLegacyServerName( const QByteArray &extraHashData );
+    void addApplicationData( QCryptographicHash &appData, const QByteArray &extraHashData );
+    void lockLegacyBlock();
+    void unlockLegacyBlock();
+    bool legacyPrimaryAlive();
+    void claimLegacyBlock();
+    void releaseLegacyBlock();
+    quint16 legacyChecksum();
     void initializeMemoryBlock();
     void startPrimary();
     void startSecondary();
-    void connectToPrimary(int msecs, ConnectionType connectionType );
-    quint16 blockChecksum();
+    bool connectToPrimary( int msecs, ConnectionType connectionType, const QByteArray &message = QByteArray() );
+    static void beginWrite( std::atomic<quint32> &sequence );
+    static void endWrite( std::atomic<quint32> &sequence );
+    static void restartWrite( std::atomic<quint32> &sequence );
+    static quint32 beginRead( const std::atomic<quint32> &sequence );
+    static bool endRead( const std::atomic<quint32> &sequence, quint32 value );
     qint64 primaryPid();
+    static qint64 monotonicMSecs();
+    static qint64 steadyNSecs();
+    static qint64 launchTime();
+    void recordPhase( const char *name, qint64 start );
+    void writeStartupTrace();
+    IpcMetrics &metrics();
+    void recordLockWait( qint64 nsecs );
+    void recordEvent( SingleApplication::IpcEvent::Type type, quint32 detail = 0, quint64 value = 0 );
+    static QList<SingleApplication::IpcEvent> readEvents( const FlightRecorder &recorder );
+    void installCrashDump();
+    void removeCrashDump();
+    void publishHeartbeat();
+    bool isPrimaryResponsive();
     QString primaryUser();
+    void registerInstance( InstanceSlot::State state );
+    void unregisterInstance();
+    void releaseSlot( InstanceSlot *slot );
+    bool reapDeadInstances();
+    static bool isProcessAlive( qint64 pid );
+    QList<SingleApplication::InstanceInfo> instances();
+    static quint64 keyHash( const QString &name );
+    static quint32 crc32c( const char *data, size_t size, quint32 crc = 0 );
+    void negotiateWithPrimary();
+    const InitMessage &buildInitMessage( ConnectionType connectionType, quint32 extensionLength = 0 );
+    const QByteArray &buildLaunchDetails();
+    static bool parseLaunchDetails( const QByteArray &extension, SingleApplication::LaunchInfo &launch );
+    bool parseInitMessage( const char *data, qint64 size, InitInfo &init, SingleApplication::IpcEvent::RejectReason &reason );
+    QByteArray buildLegacyInitMessage( ConnectionType connectionType );
+    bool parseLegacyInitMessage( const QByteArray &message, InitInfo &init, SingleApplication::IpcEvent::RejectReason &reason );
+    void readInitReply();
+    bool sendAcknowledged( const QByteArray &message, int msecs, quint32 &sequence );
+    bool waitForAcknowledgement( quint32 sequence, int msecs );
+    void readMessageFrames( QLocalSocket *socket, quint32 instanceId, qint64 launchTime, qint64 peerPid );
+    void deliverMessage( quint32 instanceId, qint64 peerPid, const QByteArray &message );
+    void expireMessages();
+    QVector<SingleApplication::Message> takeMessages( int max );
+    void startBatch();
+    QString spoolPath();
+    bool isPrimaryListening();
+    bool spoolMessage( const QByteArray &message, quint32 sequence );
+    void replaySpool();
     void readInitMessageHeader(QLocalSocket *socket);
     void readInitMessageBody(QLocalSocket *socket);
+    void rejectHandshake( QLocalSocket *socket, SingleApplication::IpcEvent::RejectReason reason );
+    static void readPeerCredentials( QLocalSocket *socket, ConnectionInfo &info );
+    int ipcEventFd();
+    void watchIpcDescriptor( qintptr descriptor );
+    void processIpcEvents();
+#ifdef SINGLEAPPLICATION_FAULT_INJECTION
+    static bool isKillPoint( const char *name );
+    static void killPoint( const char *name );
+#endif
+
+    static QString precomputedKey;
 
     SingleApplication *q_ptr;
     QSharedMemory *memory;
     QLocalSocket *socket;
     QLocalServer *server;
+    QString legacyServerName;       // Empty with a precomputed key
+    QByteArray legacyUser;
+    QSharedMemory *legacyMemory;
+    QLocalServer *legacyServer;
+    bool legacyLocked;
+    bool legacyPrimary;             // The primary instance was built against 3.x
     quint32 instanceNumber;
+    int ipcEpollFd;
+    InstanceSlot *instanceSlot;
+    QTimer *registryTimer;
+    QSet<quint64> knownInstances;
+    qint64 startupBegin;
+    QList<SingleApplication::StartupPhase> startupPhases;
     QString blockServerName;
+    quint64 blockKeyHash;
+    InitMessage initMessage;
+    QByteArray launchDetails;
+    quint16 negotiatedVersion;
+    quint32 negotiatedCapabilities;
+    bool initReplyRead;
+    quint32 messageSequence;
+    QMap<quint32, QByteArray> unacknowledged;
+    QHash<quint32, DeliveryState> deliveries;
+    bool spoolReplayPending;
+    QQueue<SingleApplication::Message> inbox;
+    int inboxCapacity;
+    int messageTimeToLive;
+    QTimer *batchTimer;
+    QVector<SingleApplication::Message> batch;
+    QSet<QByteArray> batchPayloads;
+    bool batchStarted;
     SingleApplication::Options options;
     QMap<QLocalSocket*, ConnectionInfo> connectionMap;
 
 public Q_SLOTS:
     void slotConnectionEstablished();
-    void slotDataAvailable( QLocalSocket*, quint32 );
-    void slotClientConnectionClosed( QLocalSocket*, quint32 );
+    void slotDataAvailable( QLocalSocket*, quint32, qint64 );
+    void slotClientConnectionClosed( QLocalSocket*, quint32, qint64 );
+    void slotSweepInstances();
+    void slotReapInstances();
+    void slotFlushBatch();
 };
 
 #endif // SINGLEAPPLICATION_P_H
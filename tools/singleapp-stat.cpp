@@ -0,0 +1,318 @@
+// The MIT License (MIT)
+//
+// Copyright (c) Itay Grudev 2015 - 2020
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+//
+// singleapp-stat prints the live IPC metrics SingleApplication keeps in its
+// shared memory block. It only reads the block, so it never disturbs the
+// instances it watches. It also decodes the flight recorder of the block and
+// the crash dumps written through SINGLEAPPLICATION_CRASH_DUMP.
+//
+
+#include <cstring>
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QSharedMemory>
+#include <QtCore/QTextStream>
+#include <QtCore/QThread>
+
+#include "singleapplication_p.h"
+
+/**
+ * @brief Lists the server names of the running primary instances. On Unix
+ * QLocalServer creates its socket in the temporary directory. Only names
+ * derived from a SHA-256 are recognised, not those of a precomputed key.
+ */
+static QStringList discoverKeys()
+{
+    QStringList keys;
+
+#ifdef Q_OS_UNIX
+    const QFileInfoList entries = QDir( QDir::tempPath() ).entryInfoList( QDir::System | QDir::Hidden );
+    for( const QFileInfo &entry : entries ) {
+        // Server names are a base64 encoded SHA-256 digest
+        const QString name = entry.fileName();
+        if( name.length() == 44 && name.endsWith( QLatin1Char( '=' ) ) )
+            keys.append( name );
+    }
+#endif
+
+    return keys;
+}
+
+/**
+ * @brief The server name instances started with setPrecomputedKey( key ) use.
+ * The block of the current user is preferred over the system wide one.
+ */
+static QString precomputedServerName( const QString &key )
+{
+    SingleApplicationPrivate::precomputedKey = key;
+    SingleApplicationPrivate d( nullptr );
+    d.options = SingleApplication::Mode::User;
+    d.genBlockServerName( QByteArray() );
+
+    QSharedMemory memory( d.blockServerName );
+    if( memory.attach( QSharedMemory::ReadOnly ) )
+        return d.blockServerName;
+
+    d.options = SingleApplication::Mode::System;
+    d.genBlockServerName( QByteArray() );
+    return d.blockServerName;
+}
+
+static quint64 value( const MetricsCounter &counter )
+{
+    return counter.value.load( std::memory_order_relaxed );
+}
+
+/**
+ * @brief The name of the user running the primary instance. On Unix the block
+ * only holds the uid.
+ */
+static QString primaryUser( const InstancesInfo *inst )
+{
+    const qint64 uid = inst->primaryUid.load( std::memory_order_relaxed );
+    if( uid >= 0 ) {
+        const QString name = SingleApplicationPrivate::usernameForUid( uid );
+        return name.isEmpty() ? QString::number( uid ) : name;
+    }
+    return QString::fromUtf8( inst->primaryUser, static_cast<int>( qstrnlen( inst->primaryUser, sizeof( inst->primaryUser ) ) ) );
+}
+
+static QString formatMicroseconds( qint64 usecs )
+{
+    if( usecs >= 1000 )
+        return QString::number( usecs / 1000.0, 'f', 1 ) + QStringLiteral( " ms" );
+    return QString::number( usecs ) + QStringLiteral( " us" );
+}
+
+static QString bucketLabel( int bucket )
+{
+    if( bucket == IpcMetrics::LockWaitBuckets - 1 )
+        return QStringLiteral( ">= " ) + formatMicroseconds( Q_INT64_C( 1 ) << ( bucket - 1 ) );
+    return QStringLiteral( "<  " ) + formatMicroseconds( Q_INT64_C( 1 ) << bucket );
+}
+
+static QString describeEvent( const SingleApplication::IpcEvent &event )
+{
+    using IpcEvent = SingleApplication::IpcEvent;
+
+    static const char *const connectionTypes[] = { "invalid", "new instance", "secondary instance", "reconnect" };
+    const QString connectionType = QString::fromLatin1( event.detail < 4 ? connectionTypes[event.detail] : "unknown" );
+
+    switch( event.type ) {
+    case IpcEvent::ConnectionAccepted:
+        if( static_cast<qint64>( event.value ) == -1 )
+            return QStringLiteral( "connection accepted" );
+        return QStringLiteral( "connection accepted     pid %1" ).arg( static_cast<qint64>( event.value ) );
+    case IpcEvent::HandshakeAccepted:
+        return QStringLiteral( "handshake accepted      instance %1, %2" ).arg( event.value ).arg( connectionType );
+    case IpcEvent::HandshakeRejected: {
+        static const char *const reasons[] = { "unknown", "malformed", "wrong key", "bad checksum", "too large", "wrong user" };
+        return QStringLiteral( "handshake rejected      %1" ).arg( QString::fromLatin1( reasons[event.detail < 6 ? event.detail : 0] ) );
+    }
+    case IpcEvent::MessageReceived:
+        return QStringLiteral( "message received        instance %1, %2 bytes" ).arg( event.detail ).arg( event.value );
+    case IpcEvent::BecamePrimary: {
+        static const char *const reasons[] = { "unknown", "no primary", "primary gone", "primary hung" };
+        return QStringLiteral( "became primary          %1" ).arg( QString::fromLatin1( reasons[event.detail < 4 ? event.detail : 0] ) );
+    }
+    case IpcEvent::BecameSecondary:
+        return QStringLiteral( "became secondary        instance %1" ).arg( event.value );
+    case IpcEvent::ConnectedToPrimary:
+        return QStringLiteral( "connected to primary    %1" ).arg( connectionType );
+    case IpcEvent::ConnectionFailed:
+        return QStringLiteral( "connection failed       %1" ).arg( connectionType );
+    case IpcEvent::LockWaited:
+        return QStringLiteral( "lock waited             %1" ).arg( formatMicroseconds( static_cast<qint64>( event.value / 1000 ) ) );
+    case IpcEvent::BlockRepaired:
+        return QStringLiteral( "block repaired" );
+    }
+
+    return QStringLiteral( "unknown event %1" ).arg( event.type );
+}
+
+static void printEvents( QTextStream &out, const FlightRecorder &recorder )
+{
+    const QList<SingleApplication::IpcEvent> events = SingleApplicationPrivate::readEvents( recorder );
+    if( events.isEmpty() ) {
+        out << "  no events recorded\n";
+        return;
+    }
+
+    // Times are relative to the newest event
+    const qint64 newest = events.last().time;
+    for( const SingleApplication::IpcEvent &event : events ) {
+        out << "  " << QString::number( ( event.time - newest ) / 1e6, 'f', 3 ).rightJustified( 12 ) << " ms  "
+            << QStringLiteral( "pid %1" ).arg( event.pid ).leftJustified( 12 )
+            << describeEvent( event ) << "\n";
+    }
+}
+
+/**
+ * @brief Decodes a crash dump of the flight recorder
+ */
+static bool printDump( QTextStream &out, const QString &path )
+{
+    QFile file( path );
+    if( ! file.open( QIODevice::ReadOnly ) ) {
+        out << path << ": " << file.errorString() << "\n";
+        return false;
+    }
+
+    const QByteArray dump = file.readAll();
+    quint64 magic = 0;
+    if( dump.size() == static_cast<int>( sizeof( magic ) + sizeof( FlightRecorder ) ) )
+        memcpy( &magic, dump.constData(), sizeof( magic ) );
+
+    if( magic != FlightRecorderDumpMagic ) {
+        out << path << ": not a flight recorder dump of this version of SingleApplication\n";
+        return false;
+    }
+
+    // Copy into properly aligned storage before looking at the atomics
+    FlightRecorder *recorder = new FlightRecorder;
+    memcpy( static_cast<void*>( recorder ), dump.constData() + sizeof( magic ), sizeof( FlightRecorder ) );
+
+    out << path << "\n";
+    printEvents( out, *recorder );
+    delete recorder;
+    return true;
+}
+
+static bool printStats( QTextStream &out, const QString &key, bool events )
+{
+    QSharedMemory memory( key );
+    if( ! memory.attach( QSharedMemory::ReadOnly ) ) {
+        out << key << ": " << memory.errorString() << "\n";
+        return false;
+    }
+
+    if( memory.size() < static_cast<int>( sizeof( InstancesInfo ) ) ) {
+        out << key << ": the block was created by SingleApplication 3.x, which keeps no metrics\n";
+        return false;
+    }
+
+    const InstancesInfo *inst = static_cast<const InstancesInfo*>( memory.constData() );
+    const IpcMetrics &metrics = inst->metrics;
+
+    int running = 0;
+    for( const InstanceSlot &slot : inst->instances ) {
+        const quint32 state = slot.state.load( std::memory_order_relaxed );
+        if( state == InstanceSlot::Primary || state == InstanceSlot::Secondary )
+            ++running;
+    }
+
+    out << key << "\n";
+    if( inst->primary.load( std::memory_order_relaxed ) ) {
+        const qint64 heartbeat = inst->primaryHeartbeat.load( std::memory_order_relaxed );
+        out << "  primary pid           " << inst->primaryPid.load( std::memory_order_relaxed )
+            << " (" << primaryUser( inst ) << ")\n";
+        if( heartbeat == 0 )
+            out << "  heartbeat age         none yet\n";
+        else
+            out << "  heartbeat age         " << SingleApplicationPrivate::monotonicMSecs() - heartbeat << " ms\n";
+        out << "  protocol              " << inst->primaryVersion.load( std::memory_order_relaxed )
+            << " (capabilities 0x" << QString::number( inst->primaryCapabilities.load( std::memory_order_relaxed ), 16 ) << ")\n";
+    } else {
+        out << "  primary pid           none\n";
+    }
+    out << "  registered instances  " << running << "\n";
+    out << "  primary starts        " << value( metrics.primaryStarts ) << "\n";
+    out << "  secondary starts      " << value( metrics.secondaryStarts ) << "\n";
+    out << "  connections made      " << value( metrics.connectionsMade ) << "\n";
+    out << "  connections failed    " << value( metrics.connectionsFailed ) << "\n";
+    out << "  connections accepted  " << value( metrics.connectionsAccepted ) << "\n";
+    out << "  handshakes accepted   " << value( metrics.handshakesAccepted ) << "\n";
+    out << "  handshakes rejected   " << value( metrics.handshakesRejected ) << "\n";
+    out << "  messages received     " << value( metrics.messagesReceived ) << "\n";
+    out << "  duplicates dropped    " << value( metrics.duplicatesDropped ) << "\n";
+    out << "  messages discarded    " << value( metrics.messagesDiscarded ) << "\n";
+    out << "  bytes received        " << value( metrics.bytesReceived ) << "\n";
+    out << "  startup lock waits\n";
+    for( int bucket = 0; bucket < IpcMetrics::LockWaitBuckets; ++bucket ) {
+        const quint64 count = metrics.lockWait.buckets[bucket].load( std::memory_order_relaxed );
+        if( count > 0 )
+            out << "    " << bucketLabel( bucket ).leftJustified( 18 ) << count << "\n";
+    }
+
+    if( events ) {
+        out << "  events\n";
+        printEvents( out, inst->recorder );
+    }
+
+    return true;
+}
+
+int main( int argc, char *argv[] )
+{
+    QCoreApplication app( argc, argv );
+    QCoreApplication::setApplicationName( QStringLiteral( "singleapp-stat" ) );
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription( QStringLiteral( "Prints the IPC metrics of running SingleApplication instances.\n"
+                                                      "Discovery only finds instances whose key is derived from the application (Unix only), "
+                                                      "pass the key of instances using setPrecomputedKey() with --key." ) );
+    parser.addHelpOption();
+    parser.addPositionalArgument( QStringLiteral( "name" ), QStringLiteral( "Server name of the instances to inspect. Running primary instances are discovered if neither a name nor --key is given." ), QStringLiteral( "[name...]" ) );
+    QCommandLineOption keyOption( QStringList() << QStringLiteral( "k" ) << QStringLiteral( "key" ), QStringLiteral( "Inspect the instances started with setPrecomputedKey( <key> ). May be repeated." ), QStringLiteral( "key" ) );
+    QCommandLineOption watchOption( QStringList() << QStringLiteral( "w" ) << QStringLiteral( "watch" ), QStringLiteral( "Print the metrics again every <seconds>." ), QStringLiteral( "seconds" ) );
+    QCommandLineOption eventsOption( QStringList() << QStringLiteral( "e" ) << QStringLiteral( "events" ), QStringLiteral( "Also print the flight recorder." ) );
+    QCommandLineOption dumpOption( QStringLiteral( "dump" ), QStringLiteral( "Decode a crash dump of the flight recorder instead." ), QStringLiteral( "file" ) );
+    parser.addOption( keyOption );
+    parser.addOption( watchOption );
+    parser.addOption( eventsOption );
+    parser.addOption( dumpOption );
+    parser.process( app );
+
+    QTextStream out( stdout );
+    if( parser.isSet( dumpOption ) )
+        return printDump( out, parser.value( dumpOption ) ) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    QStringList keys = parser.positionalArguments();
+    for( const QString &key : parser.values( keyOption ) )
+        keys.append( precomputedServerName( key ) );
+    if( keys.isEmpty() )
+        keys = discoverKeys();
+
+    if( keys.isEmpty() ) {
+        out << "No running SingleApplication instances found.\n";
+        return EXIT_FAILURE;
+    }
+
+    const int interval = parser.value( watchOption ).toInt();
+    while( true ) {
+        bool found = false;
+        for( const QString &key : keys )
+            found |= printStats( out, key, parser.isSet( eventsOption ) );
+        out.flush();
+
+        if( interval <= 0 )
+            return found ? EXIT_SUCCESS : EXIT_FAILURE;
+
+        QThread::sleep( static_cast<unsigned long>( interval ) );
+        out << "\n";
+    }
+}